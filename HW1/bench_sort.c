@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "libcoro.h"
+#include "merge.h"
+#include "int_io.h"
+#include "int_sort.h"
+
+// Benchmark of the HW1 sort pipeline. Datasets are generated, split into files
+// and run through the same steps as HW1: read, sort in coroutines, merge, write.
+// Every phase is timed separately, the best of the repeats is kept.
+// Usage: bench_sort [-n sizes] [-d datasets] [-c coroutine counts] [-l latencies us]
+//                   [-f files] [-r repeats] [-o results.json|results.csv]
+//                   [-compare baseline.csv] [-threshold percent]
+// Lists are comma separated, datasets are random, sorted, reverse, few-unique, zipf.
+// With -compare every phase slower than the baseline by more than the threshold
+// is reported, and the exit code is 1.
+
+#define MAX_LIST 16
+
+enum phase { PHASE_READ, PHASE_SORT, PHASE_MERGE, PHASE_WRITE, PHASE_TOTAL, PHASE_COUNT };
+
+static const char *phase_names[PHASE_COUNT] = {"read", "sort", "merge", "write", "total"};
+
+static const char *dataset_names[] = {"random", "sorted", "reverse", "few-unique", "zipf"};
+
+#define DATASET_COUNT (int) (sizeof(dataset_names) / sizeof(dataset_names[0]))
+
+typedef struct result {
+    int dataset;
+    long size;
+    int files;
+    int coros;
+    long latency;
+    u_int64_t phase_us[PHASE_COUNT];
+} result;
+
+static u_int64_t GetTimeStampUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000ull+ts.tv_nsec/1000;
+}
+
+// xorshift64*, deterministic so the runs are comparable
+static u_int64_t rand_state = 88172645463325252ull;
+
+static u_int64_t next_rand() {
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 2685821657736338717ull;
+}
+
+// zipf distribution over 1000 values with s = 1.1, by the inverse of its CDF
+static int zipf_value(const double *cdf, int n) {
+    double u = (double) (next_rand() >> 11) / (double) (1ull << 53);
+    int low = 0, high = n - 1;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (cdf[mid] < u) low = mid + 1;
+        else high = mid;
+    }
+    // scatter the ranks, so frequent values are not the smallest ones
+    return (int) ((u_int32_t) (low + 1) * 2654435761u);
+}
+
+static void generate(int dataset, int *arr, long n) {
+    rand_state = 88172645463325252ull;
+    if (dataset == 4) {
+        int values = 1000;
+        double cdf[values];
+        double sum = 0;
+        for (int i = 0; i < values; i++) {
+            sum += 1.0 / pow(i + 1, 1.1);
+            cdf[i] = sum;
+        }
+        for (int i = 0; i < values; i++) cdf[i] /= sum;
+        for (long i = 0; i < n; i++) arr[i] = zipf_value(cdf, values);
+        return;
+    }
+    for (long i = 0; i < n; i++) {
+        switch (dataset) {
+        case 0: arr[i] = (int) next_rand(); break;
+        case 1: arr[i] = (int) (i - n / 2); break;
+        case 2: arr[i] = (int) (n / 2 - i); break;
+        case 3: arr[i] = (int) (next_rand() % 16); break;
+        }
+    }
+}
+
+// write the dataset as text files, each gets an equal part
+static int write_files(char **paths, int files, const int *arr, long n) {
+    long pos = 0;
+    for (int i = 0; i < files; i++) {
+        long count = n / files + (i < n % files ? 1 : 0);
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -1;
+        struct int_writer writer;
+        int rc = int_writer_create(&writer, fd, INT_FORMAT_TEXT, INT_WRITER_BUF_SIZE);
+        if (rc == 0) {
+            rc = int_writer_write(&writer, arr + pos, count);
+            if (rc == 0) rc = int_writer_flush(&writer);
+            int_writer_destroy(&writer);
+        }
+        close(fd);
+        if (rc != 0) return -1;
+        pos += count;
+    }
+    return 0;
+}
+
+// shared state of the pipeline coroutines, they work in one thread
+typedef struct pipeline {
+    char **paths;
+    int files;
+    int next_file;
+    int **arrays;
+    size_t *sizes;
+    int failed;
+} pipeline;
+
+static int reader(void *context) {
+    pipeline *p = context;
+    while (p->next_file < p->files) {
+        int i = p->next_file++;
+        off_t error_offset;
+        if (int_file_read(p->paths[i], &p->arrays[i], &p->sizes[i], &error_offset) != 0) {
+            p->failed = 1;
+        }
+    }
+    return 0;
+}
+
+static int sorter(void *context) {
+    pipeline *p = context;
+    while (p->next_file < p->files) {
+        int i = p->next_file++;
+        int_sort(p->arrays[i], p->sizes[i], coro_yield_if_needed);
+    }
+    return 0;
+}
+
+// run coroutines until all of them have finished
+static void run_coros(int coros, coro_f func, pipeline *p) {
+    p->next_file = 0;
+    for (int i = 0; i < coros; i++) {
+        coro_new(func, p);
+    }
+    struct coro *c;
+    while ((c = coro_sched_wait()) != NULL) {
+        coro_delete(c);
+    }
+}
+
+typedef struct array_sink {
+    int *data;
+    size_t size;
+} array_sink;
+
+static int append(void *ctx, const int *batch, size_t count) {
+    array_sink *sink = ctx;
+    memcpy(sink->data + sink->size, batch, count * sizeof(int));
+    sink->size += count;
+    return 0;
+}
+
+// one run of the pipeline, phase times go into res
+static int run_pipeline(char **paths, int files, long n, int coros, long latency,
+                        const char *output, result *res) {
+    int *arrays[files];
+    size_t sizes[files];
+    for (int i = 0; i < files; i++) {
+        arrays[i] = NULL;
+        sizes[i] = 0;
+    }
+    pipeline p = {paths, files, 0, arrays, sizes, 0};
+    coro_sched_init();
+    coro_sched_set_time_slice(latency);
+
+    u_int64_t start = GetTimeStampUs();
+    run_coros(coros, reader, &p);
+    u_int64_t read_end = GetTimeStampUs();
+    run_coros(coros, sorter, &p);
+    u_int64_t sort_end = GetTimeStampUs();
+    coro_sched_destroy();
+
+    struct merge_source sources[files];
+    struct merge_source *srcs[files];
+    for (int i = 0; i < files; i++) {
+        sources[i].pos = arrays[i];
+        sources[i].end = arrays[i] + sizes[i];
+        sources[i].next = NULL;
+        srcs[i] = &sources[i];
+    }
+    array_sink sink = {malloc(n * sizeof(int) + 1), 0};
+    int batch[4096];
+    int rc = sink.data == NULL || p.failed ? -1 : 0;
+    if (rc == 0) rc = merge_k(srcs, files, batch, 4096, append, &sink);
+    u_int64_t merge_end = GetTimeStampUs();
+
+    if (rc == 0) {
+        int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        struct int_writer writer;
+        if (fd < 0 || int_writer_create(&writer, fd, INT_FORMAT_TEXT, INT_WRITER_BUF_SIZE) != 0) {
+            rc = -1;
+        } else {
+            rc = int_writer_write(&writer, sink.data, sink.size);
+            if (rc == 0) rc = int_writer_flush(&writer);
+            int_writer_destroy(&writer);
+        }
+        if (fd >= 0) close(fd);
+    }
+    u_int64_t write_end = GetTimeStampUs();
+
+    // not timed - the result must be right
+    if (rc == 0 && (long) sink.size != n) rc = -1;
+    for (size_t i = 1; rc == 0 && i < sink.size; i++) {
+        if (sink.data[i - 1] > sink.data[i]) rc = -1;
+    }
+    res->phase_us[PHASE_READ] = read_end - start;
+    res->phase_us[PHASE_SORT] = sort_end - read_end;
+    res->phase_us[PHASE_MERGE] = merge_end - sort_end;
+    res->phase_us[PHASE_WRITE] = write_end - merge_end;
+    res->phase_us[PHASE_TOTAL] = write_end - start;
+    free(sink.data);
+    for (int i = 0; i < files; i++) free(arrays[i]);
+    return rc;
+}
+
+static int parse_list(char *text, long *values) {
+    int count = 0;
+    for (char *item = strtok(text, ","); item != NULL && count < MAX_LIST; item = strtok(NULL, ",")) {
+        values[count++] = atol(item);
+    }
+    return count;
+}
+
+static int parse_datasets(char *text, int *datasets) {
+    int count = 0;
+    for (char *item = strtok(text, ","); item != NULL && count < MAX_LIST; item = strtok(NULL, ",")) {
+        for (int d = 0; d < DATASET_COUNT; d++) {
+            if (strcmp(item, dataset_names[d]) == 0) datasets[count++] = d;
+        }
+    }
+    return count;
+}
+
+static void write_results(const char *path, const result *results, int count) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        printf("Can not write %s\n", path);
+        return;
+    }
+    size_t len = strlen(path);
+    int is_json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+    if (is_json) {
+        fprintf(file, "{\"results\": [\n");
+    } else {
+        fprintf(file, "dataset,size,files,coroutines,latency_us");
+        for (int p = 0; p < PHASE_COUNT; p++) fprintf(file, ",%s_us", phase_names[p]);
+        fprintf(file, "\n");
+    }
+    for (int i = 0; i < count; i++) {
+        const result *r = &results[i];
+        if (is_json) {
+            fprintf(file, "  {\"dataset\": \"%s\", \"size\": %ld, \"files\": %d, \"coroutines\": %d, "
+                    "\"latency_us\": %ld", dataset_names[r->dataset], r->size, r->files, r->coros, r->latency);
+            for (int p = 0; p < PHASE_COUNT; p++) {
+                fprintf(file, ", \"%s_us\": %llu", phase_names[p], (unsigned long long) r->phase_us[p]);
+            }
+            fprintf(file, "}%s\n", i + 1 < count ? "," : "");
+        } else {
+            fprintf(file, "%s,%ld,%d,%d,%ld", dataset_names[r->dataset], r->size, r->files, r->coros, r->latency);
+            for (int p = 0; p < PHASE_COUNT; p++) fprintf(file, ",%llu", (unsigned long long) r->phase_us[p]);
+            fprintf(file, "\n");
+        }
+    }
+    if (is_json) fprintf(file, "]}\n");
+    fclose(file);
+}
+
+// compare with a baseline CSV written by -o, return how many phases regressed
+static int compare(const char *path, const result *results, int count, double threshold) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Can not read baseline %s\n", path);
+        return 1;
+    }
+    char line[1024];
+    int regressions = 0;
+    // skip the header
+    if (fgets(line, sizeof(line), file) == NULL) line[0] = '\0';
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[32];
+        result base;
+        unsigned long long us[PHASE_COUNT];
+        if (sscanf(line, "%31[^,],%ld,%d,%d,%ld,%llu,%llu,%llu,%llu,%llu", name, &base.size, &base.files,
+                   &base.coros, &base.latency, &us[0], &us[1], &us[2], &us[3], &us[4]) != 10) continue;
+        for (int i = 0; i < count; i++) {
+            const result *r = &results[i];
+            if (strcmp(dataset_names[r->dataset], name) != 0 || r->size != base.size || r->files != base.files ||
+                r->coros != base.coros || r->latency != base.latency) continue;
+            for (int p = 0; p < PHASE_COUNT; p++) {
+                // phases of less than 100 us are noise
+                if (r->phase_us[p] > us[p] * (1 + threshold / 100) && r->phase_us[p] > us[p] + 100) {
+                    printf("REGRESSION %s size %ld coroutines %d latency %ld: %s %llu us -> %llu us (+%.1f%%)\n",
+                           name, r->size, r->coros, r->latency, phase_names[p], us[p],
+                           (unsigned long long) r->phase_us[p], 100.0 * r->phase_us[p] / (us[p] ? us[p] : 1) - 100);
+                    regressions++;
+                }
+            }
+        }
+    }
+    fclose(file);
+    return regressions;
+}
+
+int main(int argc, char *argv[]) {
+    char default_sizes[] = "1000,100000,1000000";
+    char default_datasets[] = "random,sorted,reverse,few-unique,zipf";
+    char default_coros[] = "1,4";
+    char default_latencies[] = "0,1000";
+    char *sizes_arg = default_sizes, *datasets_arg = default_datasets;
+    char *coros_arg = default_coros, *latencies_arg = default_latencies;
+    int files = 8;
+    int repeats = 3;
+    const char *output = NULL;
+    const char *baseline = NULL;
+    double threshold = 10;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) break;
+        if (strcmp(argv[i], "-n") == 0) sizes_arg = argv[++i];
+        else if (strcmp(argv[i], "-d") == 0) datasets_arg = argv[++i];
+        else if (strcmp(argv[i], "-c") == 0) coros_arg = argv[++i];
+        else if (strcmp(argv[i], "-l") == 0) latencies_arg = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0) files = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0) repeats = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0) output = argv[++i];
+        else if (strcmp(argv[i], "-compare") == 0) baseline = argv[++i];
+        else if (strcmp(argv[i], "-threshold") == 0) threshold = atof(argv[++i]);
+    }
+    long sizes[MAX_LIST], coros[MAX_LIST], latencies[MAX_LIST];
+    int datasets[MAX_LIST];
+    int size_count = parse_list(sizes_arg, sizes);
+    int coro_count = parse_list(coros_arg, coros);
+    int latency_count = parse_list(latencies_arg, latencies);
+    int dataset_count = parse_datasets(datasets_arg, datasets);
+    if (files <= 0 || repeats <= 0) {
+        printf("Files and repeats must be positive\n");
+        return 1;
+    }
+
+    // temporary inputs and output
+    const char *tmp_dir = getenv("TMPDIR");
+    if (tmp_dir == NULL || *tmp_dir == '\0') tmp_dir = "/tmp";
+    char *paths[files];
+    for (int i = 0; i < files; i++) {
+        paths[i] = malloc(4096);
+        snprintf(paths[i], 4096, "%s/bench_sort.%d.%d.txt", tmp_dir, (int) getpid(), i);
+    }
+    char out_path[4096];
+    snprintf(out_path, sizeof(out_path), "%s/bench_sort.%d.out", tmp_dir, (int) getpid());
+
+    result *results = calloc(size_count * dataset_count * coro_count * latency_count, sizeof(result));
+    int result_count = 0;
+    int failed = 0;
+    printf("%-10s %10s %5s %8s %10s %10s %10s %10s %10s\n", "dataset", "size", "coros", "lat_us",
+           "read_us", "sort_us", "merge_us", "write_us", "total_us");
+    for (int s = 0; s < size_count; s++) {
+        for (int d = 0; d < dataset_count; d++) {
+            int *arr = malloc(sizes[s] * sizeof(int) + 1);
+            if (arr == NULL) {
+                printf("No memory for %ld numbers\n", sizes[s]);
+                failed = 1;
+                continue;
+            }
+            generate(datasets[d], arr, sizes[s]);
+            int rc = write_files(paths, files, arr, sizes[s]);
+            free(arr);
+            if (rc != 0) {
+                printf("Can not write the dataset files\n");
+                failed = 1;
+                continue;
+            }
+            for (int c = 0; c < coro_count; c++) {
+                for (int l = 0; l < latency_count; l++) {
+                    result *r = &results[result_count++];
+                    r->dataset = datasets[d];
+                    r->size = sizes[s];
+                    r->files = files;
+                    r->coros = (int) coros[c];
+                    r->latency = latencies[l];
+                    for (int rep = 0; rep < repeats; rep++) {
+                        result run;
+                        if (run_pipeline(paths, files, sizes[s], r->coros, r->latency, out_path, &run) != 0) {
+                            printf("Pipeline failed on %s of %ld\n", dataset_names[r->dataset], r->size);
+                            failed = 1;
+                            break;
+                        }
+                        // the best run is the least disturbed one
+                        for (int p = 0; p < PHASE_COUNT; p++) {
+                            if (rep == 0 || run.phase_us[p] < r->phase_us[p]) r->phase_us[p] = run.phase_us[p];
+                        }
+                    }
+                    printf("%-10s %10ld %5d %8ld %10llu %10llu %10llu %10llu %10llu\n", dataset_names[r->dataset],
+                           r->size, r->coros, r->latency, (unsigned long long) r->phase_us[PHASE_READ],
+                           (unsigned long long) r->phase_us[PHASE_SORT], (unsigned long long) r->phase_us[PHASE_MERGE],
+                           (unsigned long long) r->phase_us[PHASE_WRITE], (unsigned long long) r->phase_us[PHASE_TOTAL]);
+                }
+            }
+        }
+    }
+    for (int i = 0; i < files; i++) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+    unlink(out_path);
+
+    if (output != NULL) write_results(output, results, result_count);
+    if (baseline != NULL) {
+        int regressions = compare(baseline, results, result_count, threshold);
+        printf("%d regressions against %s\n", regressions, baseline);
+        if (regressions > 0) failed = 1;
+    }
+    free(results);
+    return failed;
+}
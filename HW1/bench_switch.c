@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libcoro.h"
+#include "coro_ctx.h"
+
+// Microbenchmark of coroutine creation and switch cost.
+// Build it once per context backend (-DCORO_CTX_ASM, -DCORO_CTX_UCONTEXT,
+// -DCORO_CTX_SIGNAL) and compare the numbers.
+// Usage: bench_switch [-n coroutines] [-y yields per coroutine]
+
+static u_int64_t GetTimeStampNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ull+ts.tv_nsec;
+}
+
+static int yields_per_coro;
+
+int yielder(void *context) {
+    (void) context;
+    for (int i = 0; i < yields_per_coro; i++) {
+        coro_yield();
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int coro_count = 10000;
+    yields_per_coro = 100;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            coro_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-y") == 0 && i + 1 < argc) {
+            yields_per_coro = atoi(argv[++i]);
+        }
+    }
+
+    coro_sched_init();
+
+    u_int64_t start = GetTimeStampNs();
+    for (int i = 0; i < coro_count; i++) {
+        coro_new(yielder, NULL);
+    }
+    u_int64_t created = GetTimeStampNs();
+
+    long long switches = 0;
+    struct coro *c;
+    while ((c = coro_sched_wait()) != NULL) {
+        switches += coro_switch_count(c);
+        coro_delete(c);
+    }
+    u_int64_t finished = GetTimeStampNs();
+
+    printf("backend: %s\n", coro_ctx_backend());
+    printf("coroutines: %d, yields per coroutine: %d\n", coro_count, yields_per_coro);
+    printf("create: %.1f ns/coro\n", (double) (created - start) / coro_count);
+    if (switches > 0) {
+        printf("switch: %.1f ns/switch (%lld switches)\n",
+               (double) (finished - created) / switches, switches);
+    }
+    return 0;
+}
@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include "coro_ctx.h"
+
+#if defined(CORO_CTX_ASM)
+
+/*
+ * The switch pushes callee-saved registers onto the current stack,
+ * stores the stack pointer into from->sp, loads to->sp and pops
+ * the registers of the other side. Everything caller-saved is
+ * already spilled by the compiler around the call.
+ *
+ * A fresh context gets a fake frame whose return address is
+ * coro_ctx_trampoline. The trampoline finds the entry function and
+ * its argument in callee-saved registers of that frame.
+ */
+#if defined(__x86_64__)
+
+__asm__(
+    ".text\n"
+    ".globl coro_ctx_switch\n"
+    ".type coro_ctx_switch, @function\n"
+    "coro_ctx_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    /* MXCSR and x87 control word are callee-saved too. */
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_ctx_switch, .-coro_ctx_switch\n"
+    "\n"
+    ".type coro_ctx_trampoline, @function\n"
+    "coro_ctx_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+    ".size coro_ctx_trampoline, .-coro_ctx_trampoline\n"
+);
+
+extern void coro_ctx_trampoline(void) __asm__("coro_ctx_trampoline");
+
+enum {
+    /** MXCSR, x87 CW, r15, r14, r13, r12, rbx, rbp, ret. */
+    CORO_CTX_FRAME_SLOTS = 8,
+};
+
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+              coro_ctx_entry_f entry, void *arg)
+{
+    uintptr_t top = ((uintptr_t) stack + stack_size) & ~(uintptr_t) 15;
+    uint64_t *frame = (uint64_t *) top - CORO_CTX_FRAME_SLOTS;
+    /* Default MXCSR 0x1f80 in low half, x87 CW 0x037f in high. */
+    frame[0] = 0x1f80 | ((uint64_t) 0x037f << 32);
+    frame[1] = 0;
+    frame[2] = 0;
+    frame[3] = (uint64_t) (uintptr_t) entry;
+    frame[4] = (uint64_t) (uintptr_t) arg;
+    frame[5] = 0;
+    frame[6] = 0;
+    frame[7] = (uint64_t) (uintptr_t) coro_ctx_trampoline;
+    ctx->sp = frame;
+}
+
+#elif defined(__aarch64__)
+
+__asm__(
+    ".text\n"
+    ".globl coro_ctx_switch\n"
+    ".type coro_ctx_switch, %function\n"
+    "coro_ctx_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    ldr x9, [x1]\n"
+    "    mov sp, x9\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size coro_ctx_switch, .-coro_ctx_switch\n"
+    "\n"
+    ".type coro_ctx_trampoline, %function\n"
+    "coro_ctx_trampoline:\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+    ".size coro_ctx_trampoline, .-coro_ctx_trampoline\n"
+);
+
+extern void coro_ctx_trampoline(void) __asm__("coro_ctx_trampoline");
+
+enum {
+    /** x19-x30 and d8-d15. */
+    CORO_CTX_FRAME_SLOTS = 20,
+};
+
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+              coro_ctx_entry_f entry, void *arg)
+{
+    uintptr_t top = ((uintptr_t) stack + stack_size) & ~(uintptr_t) 15;
+    uint64_t *frame = (uint64_t *) top - CORO_CTX_FRAME_SLOTS;
+    memset(frame, 0, CORO_CTX_FRAME_SLOTS * sizeof(*frame));
+    /* x19 - argument, x20 - entry, x30 - return address. */
+    frame[0] = (uint64_t) (uintptr_t) arg;
+    frame[1] = (uint64_t) (uintptr_t) entry;
+    frame[11] = (uint64_t) (uintptr_t) coro_ctx_trampoline;
+    ctx->sp = frame;
+}
+
+#endif
+
+const char *
+coro_ctx_backend(void)
+{
+    return "asm";
+}
+
+#elif defined(CORO_CTX_UCONTEXT)
+
+/**
+ * makecontext() passes only int arguments, so the entry and its
+ * argument are split into 32-bit halves.
+ */
+static void
+coro_ctx_trampoline(unsigned entry_hi, unsigned entry_lo,
+                    unsigned arg_hi, unsigned arg_lo)
+{
+    uintptr_t entry = ((uint64_t) entry_hi << 32) | entry_lo;
+    uintptr_t arg = ((uint64_t) arg_hi << 32) | arg_lo;
+    ((coro_ctx_entry_f) entry)((void *) arg);
+    abort();
+}
+
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+              coro_ctx_entry_f entry, void *arg)
+{
+    if (getcontext(&ctx->uc) != 0) {
+        printf("Error %s\n", strerror(errno));
+        exit(-1);
+    }
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = stack_size;
+    ctx->uc.uc_link = NULL;
+    uint64_t e = (uintptr_t) entry, a = (uintptr_t) arg;
+    makecontext(&ctx->uc, (void (*)(void)) coro_ctx_trampoline, 4,
+                (unsigned) (e >> 32), (unsigned) e,
+                (unsigned) (a >> 32), (unsigned) a);
+}
+
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+    swapcontext(&from->uc, &to->uc);
+}
+
+const char *
+coro_ctx_backend(void)
+{
+    return "ucontext";
+}
+
+#elif defined(CORO_CTX_SIGNAL)
+
+#include <signal.h>
+#include <pthread.h>
+
+#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+
+/**
+ * Buffer, used by the context constructor to escape from the
+ * signal handler back into the constructor to rollback
+ * sigaltstack etc.
+ */
+static sigjmp_buf start_point;
+/**
+ * SIGUSR2 handler and the statics below are process-wide, so M:N
+ * workers create contexts one at a time.
+ */
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Context being created, with its entry point. */
+static struct coro_ctx *start_ctx;
+static coro_ctx_entry_f start_entry;
+static void *start_arg;
+
+/**
+ * The core part of the context creation - this signal handler
+ * is run on a separate stack using sigaltstack. On an invokation
+ * it remembers its current context and jumps back to the
+ * constructor. Later the context continues from here.
+ */
+static void
+coro_ctx_body(int signum)
+{
+    (void) signum;
+    coro_ctx_entry_f entry = start_entry;
+    void *arg = start_arg;
+    struct coro_ctx *ctx = start_ctx;
+    start_ctx = NULL;
+    /*
+     * On an invokation jump back to the constructor right
+     * after remembering the context.
+     */
+    if (sigsetjmp(ctx->buf, 0) == 0)
+        siglongjmp(start_point, 1);
+    /*
+     * If the execution is here, then the context should
+     * finaly start work.
+     */
+    entry(arg);
+    abort();
+}
+
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+              coro_ctx_entry_f entry, void *arg)
+{
+    if (stack_size < SIGSTKSZ) {
+        printf("Error: stack is smaller than SIGSTKSZ\n");
+        exit(-1);
+    }
+    pthread_mutex_lock(&start_lock);
+    /*
+     * SIGUSR2 is used. First of all, block new signals to be
+     * able to set a new handler.
+     */
+    sigset_t news, olds, suss;
+    sigemptyset(&news);
+    sigaddset(&news, SIGUSR2);
+    if (pthread_sigmask(SIG_BLOCK, &news, &olds) != 0)
+        handle_error();
+    /*
+     * New handler should jump onto a new stack and remember
+     * that position. Afterwards the stack is disabled and
+     * becomes dedicated to that single context.
+     */
+    struct sigaction newsa, oldsa;
+    newsa.sa_handler = coro_ctx_body;
+    newsa.sa_flags = SA_ONSTACK;
+    sigemptyset(&newsa.sa_mask);
+    if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
+        handle_error();
+    /* Create that new stack. */
+    stack_t oldst, newst;
+    newst.ss_sp = stack;
+    newst.ss_size = stack_size;
+    newst.ss_flags = 0;
+    if (sigaltstack(&newst, &oldst) != 0)
+        handle_error();
+    /* Jump onto the stack and remember its position. */
+    start_ctx = ctx;
+    start_entry = entry;
+    start_arg = arg;
+    sigemptyset(&suss);
+    if (sigsetjmp(start_point, 1) == 0) {
+        raise(SIGUSR2);
+        while (start_ctx != NULL)
+            sigsuspend(&suss);
+    }
+    /*
+     * Return the old stack, unblock SIGUSR2. In other words,
+     * rollback all global changes. The newly created stack
+     * now is remembered only by the new context, and can be
+     * used by it only.
+     */
+    if (sigaltstack(NULL, &newst) != 0)
+        handle_error();
+    newst.ss_flags = SS_DISABLE;
+    if (sigaltstack(&newst, NULL) != 0)
+        handle_error();
+    if ((oldst.ss_flags & SS_DISABLE) == 0 &&
+        sigaltstack(&oldst, NULL) != 0)
+        handle_error();
+    if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
+        handle_error();
+    if (pthread_sigmask(SIG_SETMASK, &olds, NULL) != 0)
+        handle_error();
+    pthread_mutex_unlock(&start_lock);
+}
+
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to)
+{
+    if (sigsetjmp(from->buf, 0) == 0)
+        siglongjmp(to->buf, 1);
+}
+
+const char *
+coro_ctx_backend(void)
+{
+    return "signal";
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef CORO_CTX_INCLUDED
+#define CORO_CTX_INCLUDED
+
+#include <stddef.h>
+
+/**
+ * Machine context switching for libcoro. The backend is chosen at
+ * build time with one of the macros:
+ *
+ *     CORO_CTX_ASM      - hand-written switch for x86-64 and
+ *                         AArch64, saves only callee-saved
+ *                         registers. Default where available.
+ *     CORO_CTX_UCONTEXT - getcontext/makecontext/swapcontext.
+ *                         Portable, but every switch does a
+ *                         sigprocmask syscall.
+ *     CORO_CTX_SIGNAL   - the original sigaltstack + SIGUSR2
+ *                         trick with sigsetjmp/siglongjmp. Kept
+ *                         for comparison, single-threaded only.
+ */
+#if !defined(CORO_CTX_ASM) && !defined(CORO_CTX_UCONTEXT) && \
+    !defined(CORO_CTX_SIGNAL)
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__))
+#define CORO_CTX_ASM
+#else
+#define CORO_CTX_UCONTEXT
+#endif
+#endif
+
+#if defined(CORO_CTX_ASM)
+
+#if !defined(__x86_64__) && !defined(__aarch64__)
+#error "CORO_CTX_ASM supports only x86-64 and AArch64"
+#endif
+
+struct coro_ctx {
+    /**
+     * Saved stack pointer. Callee-saved registers and the
+     * return address are stored on the stack right below it.
+     */
+    void *sp;
+};
+
+#elif defined(CORO_CTX_UCONTEXT)
+
+#include <ucontext.h>
+
+struct coro_ctx {
+    ucontext_t uc;
+};
+
+#elif defined(CORO_CTX_SIGNAL)
+
+#include <setjmp.h>
+
+struct coro_ctx {
+    sigjmp_buf buf;
+};
+
+#else
+#error "Unknown coroutine context backend"
+#endif
+
+/** Entry point of a context. It must never return. */
+typedef void (*coro_ctx_entry_f)(void *);
+
+/**
+ * Prepare @a ctx so that the first switch into it calls
+ * @a entry(@a arg) on the given stack.
+ */
+void
+coro_ctx_make(struct coro_ctx *ctx, void *stack, size_t stack_size,
+              coro_ctx_entry_f entry, void *arg);
+
+/**
+ * Save the current context into @a from and continue @a to.
+ * Returns when somebody switches back into @a from.
+ */
+void
+coro_ctx_switch(struct coro_ctx *from, struct coro_ctx *to);
+
+/** Name of the compiled in backend. */
+const char *
+coro_ctx_backend(void);
+
+#endif /* CORO_CTX_INCLUDED */
@@ -0,0 +1,140 @@
+#ifndef CORO_INT_INCLUDED
+#define CORO_INT_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Internal interface between the libcoro scheduler and the
+ * subsystems built on top of it. Not for library users.
+ */
+
+struct coro;
+struct coro_timer;
+
+/**
+ * Reactor of one scheduler: fds waited by its coroutines, their
+ * sleep timers and, for M:N workers, an eventfd to wake the idle
+ * worker up. Only the owner thread registers waiters and polls.
+ */
+struct coro_io {
+    int epoll_fd;
+    int timer_fd;
+    /**
+     * Wakeup eventfd of an idle worker, or of the single thread
+     * scheduler waiting for other threads. -1 if not needed.
+     */
+    int event_fd;
+    /** Deadline the timerfd is armed to, 0 if disarmed. */
+    uint64_t timer_armed;
+    /** Min-heap of sleeping coroutines. */
+    struct coro_timer *timers;
+    int timer_count;
+    int timer_capacity;
+    /** How many coroutines wait for fds. */
+    int fd_waiter_count;
+};
+
+/** True, if the caller is a coroutine, not the scheduler. */
+bool
+coro_is_coro(void);
+
+/**
+ * Block the current coroutine until somebody calls coro_wakeup()
+ * on it. The scheduler runs other coroutines meanwhile.
+ */
+void
+coro_park(void);
+
+/**
+ * Same as coro_park(), but @a lock, held by the caller, is
+ * released only after the coroutine has left its stack. So a
+ * waker, taking the lock, always finds the coroutine parked.
+ */
+void
+coro_park_unlock(pthread_mutex_t *lock);
+
+/**
+ * Make a parked coroutine ready to run again. It is queued to the
+ * scheduler of the calling thread, or to its last one if the
+ * caller is not a scheduler thread.
+ */
+void
+coro_wakeup(struct coro *c);
+
+/**
+ * Announce a wakeup, which is going to come from a not scheduler
+ * thread - a thread pool worker, for example. While such wakeups
+ * are expected, the single thread scheduler sleeps in the reactor
+ * instead of reporting all the coroutines blocked. Called by a
+ * coroutine before it hands the work over.
+ */
+void
+coro_remote_ref(void);
+
+/**
+ * Drop the reference of coro_remote_ref(). Called by the waker
+ * after its coro_wakeup(), or instead of it.
+ */
+void
+coro_remote_unref(void);
+
+/** Reactor of the scheduler of the calling thread. */
+struct coro_io *
+coro_sched_io(void);
+
+/** Trace API, used by the scheduler. */
+
+/** How a coroutine turn has ended. */
+enum coro_trace_reason {
+    CORO_TRACE_YIELD,
+    CORO_TRACE_PARK,
+    CORO_TRACE_FINISH,
+};
+
+/** True, if the trace is being recorded. */
+bool
+coro_trace_is_on(void);
+
+/** Record one turn of a coroutine on a scheduler thread. */
+void
+coro_trace_slice(uint64_t coro_id, int thread_id, uint64_t start_ns,
+                 uint64_t duration_ns, enum coro_trace_reason reason);
+
+/** Reactor API, used by the scheduler. */
+
+/** Set the reactor to the empty state. No descriptors created. */
+void
+coro_io_init(struct coro_io *io);
+
+/**
+ * Create the descriptors and the wakeup eventfd, so the reactor
+ * can be used to sleep while idle.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_io_enable_notify(struct coro_io *io);
+
+/** Wake up the thread blocked in coro_io_poll() on @a io. */
+void
+coro_io_notify(struct coro_io *io);
+
+/** How many coroutines wait for fds or timers. */
+int
+coro_io_waiter_count(const struct coro_io *io);
+
+/**
+ * Check fds and timers and wake up the coroutines whose events
+ * have happened. With @a block wait until at least one of them,
+ * or a notification.
+ */
+void
+coro_io_poll(struct coro_io *io, bool block);
+
+/** Close the reactor descriptors. */
+void
+coro_io_destroy(struct coro_io *io);
+
+#endif /* CORO_INT_INCLUDED */
@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "libcoro.h"
+#include "coro_int.h"
+
+/**
+ * Reactor of the I/O-aware scheduler. Coroutines waiting for an fd
+ * are registered in epoll, sleeping ones are kept in a min-heap by
+ * deadline with a single timerfd armed to the earliest of them.
+ * The scheduler polls the reactor between coroutine turns and
+ * blocks in it when nobody is ready to run. All the descriptors
+ * are created on the first use, so plain CPU-bound programs pay
+ * nothing. Each scheduler thread has its own reactor.
+ */
+
+enum {
+    /** How many events are taken by one epoll_wait(). */
+    CORO_IO_EVENT_BATCH = 64,
+};
+
+/** A coroutine waiting for an fd. Lives on its stack. */
+struct coro_io_wait {
+    struct coro *coro;
+    /** Reactor the fd is registered in. */
+    struct coro_io *io;
+};
+
+/** A sleeping coroutine. */
+struct coro_timer {
+    /** CLOCK_MONOTONIC time to wake up at, in microseconds. */
+    uint64_t deadline;
+    struct coro *coro;
+};
+
+static uint64_t
+coro_io_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+coro_io_init(struct coro_io *io)
+{
+    memset(io, 0, sizeof(*io));
+    io->epoll_fd = io->timer_fd = io->event_fd = -1;
+}
+
+/** Create epoll and timerfd descriptors on the first use. */
+static int
+coro_io_start(struct coro_io *io)
+{
+    if (io->epoll_fd >= 0)
+        return 0;
+    io->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (io->epoll_fd < 0)
+        return -1;
+    io->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (io->timer_fd < 0)
+        goto error;
+    /* NULL data marks the timer among the fd waiters. */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->timer_fd, &ev) != 0)
+        goto error;
+    return 0;
+error:
+    coro_io_destroy(io);
+    return -1;
+}
+
+int
+coro_io_enable_notify(struct coro_io *io)
+{
+    if (coro_io_start(io) != 0)
+        return -1;
+    io->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->event_fd < 0)
+        return -1;
+    /* The reactor itself marks the eventfd. */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = io;
+    return epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->event_fd, &ev);
+}
+
+void
+coro_io_notify(struct coro_io *io)
+{
+    uint64_t one = 1;
+    if (write(io->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        printf("Error %s\n", strerror(errno));
+        exit(-1);
+    }
+}
+
+void
+coro_io_destroy(struct coro_io *io)
+{
+    if (io->event_fd >= 0)
+        close(io->event_fd);
+    if (io->timer_fd >= 0)
+        close(io->timer_fd);
+    if (io->epoll_fd >= 0)
+        close(io->epoll_fd);
+    free(io->timers);
+    coro_io_init(io);
+}
+
+int
+coro_io_waiter_count(const struct coro_io *io)
+{
+    return io->fd_waiter_count + io->timer_count;
+}
+
+static void
+coro_timer_swap(struct coro_timer *timers, int a, int b)
+{
+    struct coro_timer tmp = timers[a];
+    timers[a] = timers[b];
+    timers[b] = tmp;
+}
+
+static int
+coro_timer_push(struct coro_io *io, uint64_t deadline, struct coro *c)
+{
+    if (io->timer_count == io->timer_capacity) {
+        int capacity = io->timer_capacity == 0 ? 16 : io->timer_capacity * 2;
+        struct coro_timer *new_timers =
+            realloc(io->timers, capacity * sizeof(*io->timers));
+        if (new_timers == NULL)
+            return -1;
+        io->timers = new_timers;
+        io->timer_capacity = capacity;
+    }
+    struct coro_timer *timers = io->timers;
+    int i = io->timer_count++;
+    timers[i].deadline = deadline;
+    timers[i].coro = c;
+    while (i > 0 && timers[(i - 1) / 2].deadline > timers[i].deadline) {
+        coro_timer_swap(timers, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    return 0;
+}
+
+static void
+coro_timer_pop(struct coro_io *io)
+{
+    struct coro_timer *timers = io->timers;
+    int count = --io->timer_count;
+    timers[0] = timers[count];
+    int i = 0;
+    for (;;) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < count && timers[l].deadline < timers[min].deadline)
+            min = l;
+        if (r < count && timers[r].deadline < timers[min].deadline)
+            min = r;
+        if (min == i)
+            break;
+        coro_timer_swap(timers, i, min);
+        i = min;
+    }
+}
+
+/** Point the timerfd to the earliest deadline, if it changed. */
+static void
+coro_timer_arm(struct coro_io *io)
+{
+    uint64_t deadline = io->timer_count > 0 ? io->timers[0].deadline : 0;
+    if (deadline == io->timer_armed)
+        return;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / 1000000;
+    its.it_value.tv_nsec = (deadline % 1000000) * 1000;
+    if (timerfd_settime(io->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+        printf("Error %s\n", strerror(errno));
+        exit(-1);
+    }
+    io->timer_armed = deadline;
+}
+
+/** Wake up everybody whose deadline has come. */
+static void
+coro_timer_expire(struct coro_io *io)
+{
+    uint64_t expirations;
+    while (read(io->timer_fd, &expirations, sizeof(expirations)) > 0);
+    uint64_t now = coro_io_now();
+    while (io->timer_count > 0 && io->timers[0].deadline <= now) {
+        struct coro *c = io->timers[0].coro;
+        coro_timer_pop(io);
+        coro_wakeup(c);
+    }
+    /* Force re-arm, the fired timer is disarmed by the kernel. */
+    io->timer_armed = 0;
+    coro_timer_arm(io);
+}
+
+void
+coro_io_poll(struct coro_io *io, bool block)
+{
+    if (io->epoll_fd < 0)
+        return;
+    struct epoll_event events[CORO_IO_EVENT_BATCH];
+    int count = epoll_wait(io->epoll_fd, events, CORO_IO_EVENT_BATCH,
+                           block ? -1 : 0);
+    for (int i = 0; i < count; i++) {
+        void *ptr = events[i].data.ptr;
+        if (ptr == NULL) {
+            coro_timer_expire(io);
+            continue;
+        }
+        if (ptr == io) {
+            uint64_t value;
+            while (read(io->event_fd, &value, sizeof(value)) > 0);
+            continue;
+        }
+        struct coro_io_wait *w = ptr;
+        --io->fd_waiter_count;
+        coro_wakeup(w->coro);
+    }
+}
+
+/**
+ * errno of the current thread. A coroutine can resume on another
+ * thread, so the errno address must not be cached across a park.
+ */
+static __attribute__((noinline)) int
+coro_io_errno(void)
+{
+    __asm__ volatile("" ::: "memory");
+    return errno;
+}
+
+/**
+ * Park the current coroutine until @a fd has any of @a events.
+ * Outside of coroutines just block the thread in poll().
+ * @retval 0 The fd is ready, or it can not be polled (a regular
+ *     file) and the caller should just do the operation.
+ * @retval -1 Error, errno is set.
+ */
+static int
+coro_io_wait_fd(int fd, uint32_t events)
+{
+    if (! coro_is_coro()) {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = (short) events;
+        return poll(&pfd, 1, -1) < 0 && errno != EINTR ? -1 : 0;
+    }
+    struct coro_io *io = coro_sched_io();
+    if (coro_io_start(io) != 0)
+        return -1;
+    struct coro_io_wait w;
+    w.coro = coro_this();
+    w.io = io;
+    struct epoll_event ev;
+    /*
+     * One shot - the scheduler must not wake the coroutine again
+     * before it is back here to unregister the fd.
+     */
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = &w;
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        return errno == EPERM ? 0 : -1;
+    ++io->fd_waiter_count;
+    coro_park();
+    epoll_ctl(w.io->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    return 0;
+}
+
+static bool
+coro_io_would_block(void)
+{
+    int err = coro_io_errno();
+    return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+ssize_t
+coro_read(int fd, void *buf, size_t count)
+{
+    for (;;) {
+        ssize_t rc = read(fd, buf, count);
+        if (rc >= 0)
+            return rc;
+        if (coro_io_errno() == EINTR)
+            continue;
+        if (! coro_io_would_block() || coro_io_wait_fd(fd, EPOLLIN) != 0)
+            return -1;
+    }
+}
+
+ssize_t
+coro_write(int fd, const void *buf, size_t count)
+{
+    size_t done = 0;
+    while (done < count) {
+        ssize_t rc = write(fd, (const char *) buf + done, count - done);
+        if (rc >= 0) {
+            done += rc;
+            continue;
+        }
+        if (coro_io_errno() == EINTR)
+            continue;
+        if (! coro_io_would_block() || coro_io_wait_fd(fd, EPOLLOUT) != 0)
+            return done > 0 ? (ssize_t) done : -1;
+    }
+    return done;
+}
+
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    for (;;) {
+        int rc = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (rc >= 0)
+            return rc;
+        if (coro_io_errno() == EINTR)
+            continue;
+        if (! coro_io_would_block() || coro_io_wait_fd(fd, EPOLLIN) != 0)
+            return -1;
+    }
+}
+
+int
+coro_sleep_us(uint64_t usec)
+{
+    if (! coro_is_coro()) {
+        struct timespec ts;
+        ts.tv_sec = usec / 1000000;
+        ts.tv_nsec = (usec % 1000000) * 1000;
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+        return 0;
+    }
+    if (usec == 0) {
+        coro_yield();
+        return 0;
+    }
+    struct coro_io *io = coro_sched_io();
+    if (coro_io_start(io) != 0 ||
+        coro_timer_push(io, coro_io_now() + usec, coro_this()) != 0)
+        return -1;
+    coro_timer_arm(io);
+    coro_park();
+    return 0;
+}
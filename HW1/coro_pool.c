@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "libcoro.h"
+#include "coro_int.h"
+#include "coro_pool.h"
+
+struct coro_pool_batch {
+    struct thread_pool *pool;
+    /** Protects everything below. */
+    pthread_mutex_t lock;
+    /** Pushed and not yet finished tasks. */
+    int pending;
+    /** Parked coroutine waiting for the batch, NULL if none. */
+    struct coro *waiter;
+    /** Condition of a waiting thread. */
+    pthread_cond_t cond;
+    /** Pushed jobs, joined by coro_pool_batch_wait(). */
+    struct coro_pool_job **jobs;
+    int job_count;
+    int job_capacity;
+};
+
+/** One task of a batch, with the task memory embedded. */
+struct coro_pool_job {
+    struct thread_task_storage storage;
+    struct thread_task *task;
+    struct coro_pool_batch *batch;
+    thread_task_f function;
+    void *arg;
+};
+
+/**
+ * Run the job and complete it in the batch. The batch is not
+ * touched after the lock is released - the woken coroutine may
+ * delete it right away.
+ */
+static void *
+coro_pool_job_f(void *arg)
+{
+    struct coro_pool_job *job = arg;
+    struct coro_pool_batch *b = job->batch;
+    job->function(job->arg);
+    pthread_mutex_lock(&b->lock);
+    if (--b->pending == 0) {
+        if (b->waiter != NULL) {
+            coro_wakeup(b->waiter);
+            b->waiter = NULL;
+        }
+        pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+    coro_remote_unref();
+    return NULL;
+}
+
+struct coro_pool_batch *
+coro_pool_batch_new(struct thread_pool *pool)
+{
+    struct coro_pool_batch *b = malloc(sizeof(*b));
+    if (b == NULL)
+        return NULL;
+    b->pool = pool;
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    b->pending = 0;
+    b->waiter = NULL;
+    b->jobs = NULL;
+    b->job_count = 0;
+    b->job_capacity = 0;
+    return b;
+}
+
+void
+coro_pool_batch_delete(struct coro_pool_batch *b)
+{
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+    free(b->jobs);
+    free(b);
+}
+
+int
+coro_pool_batch_push(struct coro_pool_batch *b, thread_task_f function,
+                     void *arg)
+{
+    if (b->job_count == b->job_capacity) {
+        int capacity = b->job_capacity > 0 ? b->job_capacity * 2 : 16;
+        struct coro_pool_job **jobs =
+            realloc(b->jobs, capacity * sizeof(jobs[0]));
+        if (jobs == NULL)
+            return TPOOL_ERR_TOO_MANY_TASKS;
+        b->jobs = jobs;
+        b->job_capacity = capacity;
+    }
+    struct coro_pool_job *job = malloc(sizeof(*job));
+    if (job == NULL)
+        return TPOOL_ERR_TOO_MANY_TASKS;
+    job->batch = b;
+    job->function = function;
+    job->arg = arg;
+    struct thread_task *task;
+    thread_task_init(&task, &job->storage, coro_pool_job_f, job);
+    job->task = task;
+    pthread_mutex_lock(&b->lock);
+    ++b->pending;
+    pthread_mutex_unlock(&b->lock);
+    coro_remote_ref();
+    int rc = thread_pool_push_task(b->pool, task);
+    if (rc != 0) {
+        pthread_mutex_lock(&b->lock);
+        --b->pending;
+        pthread_mutex_unlock(&b->lock);
+        coro_remote_unref();
+        thread_task_delete(task);
+        free(job);
+        return rc;
+    }
+    b->jobs[b->job_count++] = job;
+    return 0;
+}
+
+void
+coro_pool_batch_wait(struct coro_pool_batch *b)
+{
+    pthread_mutex_lock(&b->lock);
+    while (b->pending > 0) {
+        if (coro_is_coro()) {
+            b->waiter = coro_this();
+            coro_park_unlock(&b->lock);
+            pthread_mutex_lock(&b->lock);
+        } else {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    /*
+     * The functions have returned, the joins only wait for the pool
+     * to mark the tasks finished. After them the pool has no tasks
+     * of the batch, so it can be deleted.
+     */
+    for (int i = 0; i < b->job_count; i++) {
+        void *result;
+        thread_task_join(b->jobs[i]->task, &result);
+        thread_task_delete(b->jobs[i]->task);
+        free(b->jobs[i]);
+    }
+    b->job_count = 0;
+}
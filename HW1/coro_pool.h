@@ -0,0 +1,44 @@
+#ifndef CORO_POOL_INCLUDED
+#define CORO_POOL_INCLUDED
+
+#include "../HW4/thread_pool.h"
+
+/**
+ * Thread pool tasks awaited by coroutines. A coroutine pushes
+ * CPU-heavy work into a thread_pool and parks until all of it is
+ * done. The last finished task wakes the coroutine up through the
+ * scheduler, no OS thread is blocked meanwhile and the other
+ * coroutines keep running.
+ */
+
+struct coro_pool_batch;
+
+/** Create an empty batch of tasks for @a pool. NULL, if no memory. */
+struct coro_pool_batch *
+coro_pool_batch_new(struct thread_pool *pool);
+
+/** Delete a batch. It must have no unfinished tasks. */
+void
+coro_pool_batch_delete(struct coro_pool_batch *b);
+
+/**
+ * Run @a function(@a arg) in a pool thread as a task of the batch.
+ * Its result is dropped, @a arg is the place for the output.
+ * @retval 0 Success.
+ * @retval != 0 Error code of thread_pool_push_task(), the task is
+ *         not pushed.
+ */
+int
+coro_pool_batch_push(struct coro_pool_batch *b, thread_task_f function,
+                     void *arg);
+
+/**
+ * Park the coroutine until all the pushed tasks are finished. Not
+ * from a coroutine, block the thread. The batch can be used for
+ * new tasks afterwards. Each batch with pushed tasks must be waited
+ * for before its coroutine ends.
+ */
+void
+coro_pool_batch_wait(struct coro_pool_batch *b);
+
+#endif /* CORO_POOL_INCLUDED */
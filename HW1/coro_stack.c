@@ -0,0 +1,172 @@
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "coro_stack.h"
+
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+enum {
+    /** How many different stack sizes the cache tracks. */
+    CORO_STACK_CACHE_CLASSES = 8,
+};
+
+/**
+ * Free stacks are linked through a node placed at the very top of
+ * the stack. The top page is always touched by a coroutine, so the
+ * node costs no extra memory.
+ */
+struct coro_stack_node {
+    struct coro_stack_node *next;
+    void *map;
+};
+
+/** Free stacks of one mapping size. */
+struct coro_stack_class {
+    size_t map_size;
+    struct coro_stack_node *head;
+};
+
+static struct coro_stack_class stack_classes[CORO_STACK_CACHE_CLASSES];
+/** Total number of cached stacks in all the classes. */
+static int stack_cache_count = 0;
+static size_t page_size = 0;
+/** The cache is shared by all the M:N workers. */
+static pthread_mutex_t stack_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+coro_stack_page_size(void)
+{
+    if (page_size == 0)
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+static struct coro_stack_node *
+coro_stack_node(void *map, size_t map_size)
+{
+    return (struct coro_stack_node *)
+        ((char *) map + map_size - sizeof(struct coro_stack_node));
+}
+
+int
+coro_stack_alloc(struct coro_stack *stack, size_t size)
+{
+    size_t page = coro_stack_page_size();
+    if (size < CORO_STACK_MIN_SIZE)
+        size = CORO_STACK_MIN_SIZE;
+    size = (size + page - 1) & ~(page - 1);
+    size_t map_size = size + page;
+
+    pthread_mutex_lock(&stack_cache_lock);
+    for (int i = 0; i < CORO_STACK_CACHE_CLASSES; i++) {
+        struct coro_stack_class *cls = &stack_classes[i];
+        if (cls->map_size != map_size || cls->head == NULL)
+            continue;
+        struct coro_stack_node *node = cls->head;
+        cls->head = node->next;
+        --stack_cache_count;
+        pthread_mutex_unlock(&stack_cache_lock);
+        stack->map = node->map;
+        stack->map_size = map_size;
+        return 0;
+    }
+    pthread_mutex_unlock(&stack_cache_lock);
+
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                     -1, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    /* Stacks grow down, so the guard is at the lowest address. */
+    if (mprotect(map, page, PROT_NONE) != 0) {
+        munmap(map, map_size);
+        return -1;
+    }
+    stack->map = map;
+    stack->map_size = map_size;
+    return 0;
+}
+
+void
+coro_stack_free(struct coro_stack *stack)
+{
+    if (stack->map == NULL)
+        return;
+    struct coro_stack_class *cls = NULL;
+    pthread_mutex_lock(&stack_cache_lock);
+    if (stack_cache_count < CORO_STACK_CACHE_MAX) {
+        for (int i = 0; i < CORO_STACK_CACHE_CLASSES; i++) {
+            struct coro_stack_class *it = &stack_classes[i];
+            if (it->map_size == stack->map_size) {
+                cls = it;
+                break;
+            }
+            if (cls == NULL && it->head == NULL)
+                cls = it;
+        }
+    }
+    if (cls == NULL) {
+        pthread_mutex_unlock(&stack_cache_lock);
+        munmap(stack->map, stack->map_size);
+        stack->map = NULL;
+        return;
+    }
+    /*
+     * Keep only the top of the stack committed, a deep recursion
+     * of a previous owner should not pin its pages forever.
+     */
+    size_t page = coro_stack_page_size();
+    size_t usable = stack->map_size - page;
+    if (usable > CORO_STACK_HOT_SIZE) {
+        char *cold = (char *) stack->map + page;
+        size_t cold_size = usable - CORO_STACK_HOT_SIZE;
+#ifdef MADV_FREE
+        if (madvise(cold, cold_size, MADV_FREE) != 0)
+#endif
+            madvise(cold, cold_size, MADV_DONTNEED);
+    }
+    cls->map_size = stack->map_size;
+    struct coro_stack_node *node = coro_stack_node(stack->map,
+                                                   stack->map_size);
+    node->map = stack->map;
+    node->next = cls->head;
+    cls->head = node;
+    ++stack_cache_count;
+    pthread_mutex_unlock(&stack_cache_lock);
+    stack->map = NULL;
+}
+
+void *
+coro_stack_base(const struct coro_stack *stack)
+{
+    return (char *) stack->map + coro_stack_page_size();
+}
+
+size_t
+coro_stack_size(const struct coro_stack *stack)
+{
+    return stack->map_size - coro_stack_page_size();
+}
+
+void
+coro_stack_cache_drain(void)
+{
+    pthread_mutex_lock(&stack_cache_lock);
+    for (int i = 0; i < CORO_STACK_CACHE_CLASSES; i++) {
+        struct coro_stack_class *cls = &stack_classes[i];
+        while (cls->head != NULL) {
+            struct coro_stack_node *node = cls->head;
+            cls->head = node->next;
+            munmap(node->map, cls->map_size);
+        }
+        cls->map_size = 0;
+    }
+    stack_cache_count = 0;
+    pthread_mutex_unlock(&stack_cache_lock);
+}
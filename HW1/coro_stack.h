@@ -0,0 +1,60 @@
+#ifndef CORO_STACK_INCLUDED
+#define CORO_STACK_INCLUDED
+
+#include <stddef.h>
+
+/**
+ * Coroutine stacks. Each stack is a separate anonymous mapping
+ * with a PROT_NONE guard page below its lowest usable address, so
+ * an overflow crashes with SIGSEGV instead of corrupting the heap.
+ * Pages are committed by the kernel only when touched. Freed
+ * stacks are kept in a bounded cache and reused by the next
+ * allocation of the same size.
+ */
+struct coro_stack {
+    /** Start of the mapping, the guard page is here. */
+    void *map;
+    /** Size of the whole mapping with the guard page. */
+    size_t map_size;
+};
+
+enum {
+    /** Default usable stack size. */
+    CORO_STACK_DEFAULT_SIZE = 1024 * 1024,
+    /** Smallest usable stack size. */
+    CORO_STACK_MIN_SIZE = 16 * 1024,
+    /** How many free stacks the cache may keep. */
+    CORO_STACK_CACHE_MAX = 1024,
+    /**
+     * How many bytes at the top of a cached stack stay
+     * committed. The rest is given back to the kernel.
+     */
+    CORO_STACK_HOT_SIZE = 64 * 1024,
+};
+
+/**
+ * Take a stack with at least @a size usable bytes from the cache
+ * or map a new one.
+ * @retval 0 Success.
+ * @retval -1 Mapping failed, errno is set.
+ */
+int
+coro_stack_alloc(struct coro_stack *stack, size_t size);
+
+/** Give the stack back to the cache or unmap it. */
+void
+coro_stack_free(struct coro_stack *stack);
+
+/** Lowest usable address of the stack. */
+void *
+coro_stack_base(const struct coro_stack *stack);
+
+/** Usable size of the stack. */
+size_t
+coro_stack_size(const struct coro_stack *stack);
+
+/** Unmap all cached stacks. */
+void
+coro_stack_cache_drain(void);
+
+#endif /* CORO_STACK_INCLUDED */
@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "libcoro.h"
+#include "coro_int.h"
+#include "coro_sync.h"
+
+/**
+ * A coroutine or a thread waiting in a primitive. Lives on the
+ * stack of the waiter and is linked into the wait queue of the
+ * primitive. Everything is protected by the lock of the primitive.
+ */
+struct coro_waiter {
+    /** Parked coroutine, NULL if a thread waits. */
+    struct coro *coro;
+    /** Condition of a waiting thread. */
+    pthread_cond_t cond;
+    /** Element to send or a place for a received one. */
+    void *data;
+    /** Result, set by the waker. */
+    int status;
+    /** True, when the waiter is woken up. */
+    bool is_done;
+    struct coro_waiter *next;
+};
+
+/** FIFO of waiters. */
+struct coro_wait_queue {
+    struct coro_waiter *head;
+    struct coro_waiter *tail;
+};
+
+struct coro_mutex {
+    pthread_mutex_t lock;
+    bool is_locked;
+    struct coro_wait_queue waiters;
+};
+
+struct coro_cond {
+    pthread_mutex_t lock;
+    struct coro_wait_queue waiters;
+};
+
+struct coro_wg {
+    pthread_mutex_t lock;
+    int counter;
+    struct coro_wait_queue waiters;
+};
+
+struct coro_chan {
+    pthread_mutex_t lock;
+    /** Ring buffer of capacity elements. */
+    char *buf;
+    size_t elem_size;
+    size_t capacity;
+    /** Index of the oldest element and how many are buffered. */
+    size_t head;
+    size_t count;
+    bool is_closed;
+    struct coro_wait_queue senders;
+    struct coro_wait_queue receivers;
+};
+
+static void
+coro_wait_queue_push(struct coro_wait_queue *q, struct coro_waiter *w)
+{
+    w->next = NULL;
+    if (q->tail == NULL)
+        q->head = w;
+    else
+        q->tail->next = w;
+    q->tail = w;
+}
+
+static struct coro_waiter *
+coro_wait_queue_pop(struct coro_wait_queue *q)
+{
+    struct coro_waiter *w = q->head;
+    if (w == NULL)
+        return NULL;
+    q->head = w->next;
+    if (q->head == NULL)
+        q->tail = NULL;
+    return w;
+}
+
+static void
+coro_waiter_init(struct coro_waiter *w, void *data)
+{
+    w->coro = coro_is_coro() ? coro_this() : NULL;
+    if (w->coro == NULL)
+        pthread_cond_init(&w->cond, NULL);
+    w->data = data;
+    w->status = 0;
+    w->is_done = false;
+    w->next = NULL;
+}
+
+/**
+ * Wait until the waiter, already queued, is woken up. @a lock of
+ * the primitive is held on entry and released on return.
+ */
+static int
+coro_waiter_park(struct coro_waiter *w, pthread_mutex_t *lock)
+{
+    if (w->coro != NULL) {
+        coro_park_unlock(lock);
+        return w->status;
+    }
+    while (! w->is_done)
+        pthread_cond_wait(&w->cond, lock);
+    pthread_mutex_unlock(lock);
+    pthread_cond_destroy(&w->cond);
+    return w->status;
+}
+
+/** Wake a dequeued waiter up. The primitive lock is held. */
+static void
+coro_waiter_wake(struct coro_waiter *w, int status)
+{
+    w->status = status;
+    w->is_done = true;
+    if (w->coro != NULL)
+        coro_wakeup(w->coro);
+    else
+        pthread_cond_signal(&w->cond);
+}
+
+/** Mutex. */
+
+struct coro_mutex *
+coro_mutex_new(void)
+{
+    struct coro_mutex *m = calloc(1, sizeof(*m));
+    if (m != NULL)
+        pthread_mutex_init(&m->lock, NULL);
+    return m;
+}
+
+void
+coro_mutex_delete(struct coro_mutex *m)
+{
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+}
+
+void
+coro_mutex_lock(struct coro_mutex *m)
+{
+    pthread_mutex_lock(&m->lock);
+    if (! m->is_locked) {
+        m->is_locked = true;
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+    struct coro_waiter w;
+    coro_waiter_init(&w, NULL);
+    coro_wait_queue_push(&m->waiters, &w);
+    /* The unlocker hands the mutex over, it is still locked. */
+    coro_waiter_park(&w, &m->lock);
+}
+
+bool
+coro_mutex_trylock(struct coro_mutex *m)
+{
+    pthread_mutex_lock(&m->lock);
+    bool ok = ! m->is_locked;
+    m->is_locked = true;
+    pthread_mutex_unlock(&m->lock);
+    return ok;
+}
+
+void
+coro_mutex_unlock(struct coro_mutex *m)
+{
+    pthread_mutex_lock(&m->lock);
+    struct coro_waiter *w = coro_wait_queue_pop(&m->waiters);
+    if (w != NULL)
+        coro_waiter_wake(w, 0);
+    else
+        m->is_locked = false;
+    pthread_mutex_unlock(&m->lock);
+}
+
+/** Condition variable. */
+
+struct coro_cond *
+coro_cond_new(void)
+{
+    struct coro_cond *c = calloc(1, sizeof(*c));
+    if (c != NULL)
+        pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+void
+coro_cond_delete(struct coro_cond *c)
+{
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m)
+{
+    struct coro_waiter w;
+    coro_waiter_init(&w, NULL);
+    pthread_mutex_lock(&c->lock);
+    coro_wait_queue_push(&c->waiters, &w);
+    /*
+     * The waiter is queued before the mutex is released, so a
+     * signal sent right after the unlock is not lost.
+     */
+    coro_mutex_unlock(m);
+    coro_waiter_park(&w, &c->lock);
+    coro_mutex_lock(m);
+}
+
+void
+coro_cond_signal(struct coro_cond *c)
+{
+    pthread_mutex_lock(&c->lock);
+    struct coro_waiter *w = coro_wait_queue_pop(&c->waiters);
+    if (w != NULL)
+        coro_waiter_wake(w, 0);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void
+coro_cond_broadcast(struct coro_cond *c)
+{
+    pthread_mutex_lock(&c->lock);
+    struct coro_waiter *w;
+    while ((w = coro_wait_queue_pop(&c->waiters)) != NULL)
+        coro_waiter_wake(w, 0);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/** Wait group. */
+
+struct coro_wg *
+coro_wg_new(void)
+{
+    struct coro_wg *wg = calloc(1, sizeof(*wg));
+    if (wg != NULL)
+        pthread_mutex_init(&wg->lock, NULL);
+    return wg;
+}
+
+void
+coro_wg_delete(struct coro_wg *wg)
+{
+    pthread_mutex_destroy(&wg->lock);
+    free(wg);
+}
+
+void
+coro_wg_add(struct coro_wg *wg, int delta)
+{
+    pthread_mutex_lock(&wg->lock);
+    wg->counter += delta;
+    if (wg->counter < 0) {
+        printf("Critical error - negative wait group counter!\n");
+        exit(-1);
+    }
+    if (wg->counter == 0) {
+        struct coro_waiter *w;
+        while ((w = coro_wait_queue_pop(&wg->waiters)) != NULL)
+            coro_waiter_wake(w, 0);
+    }
+    pthread_mutex_unlock(&wg->lock);
+}
+
+void
+coro_wg_done(struct coro_wg *wg)
+{
+    coro_wg_add(wg, -1);
+}
+
+void
+coro_wg_wait(struct coro_wg *wg)
+{
+    pthread_mutex_lock(&wg->lock);
+    if (wg->counter == 0) {
+        pthread_mutex_unlock(&wg->lock);
+        return;
+    }
+    struct coro_waiter w;
+    coro_waiter_init(&w, NULL);
+    coro_wait_queue_push(&wg->waiters, &w);
+    coro_waiter_park(&w, &wg->lock);
+}
+
+/** Channel. */
+
+struct coro_chan *
+coro_chan_new(size_t elem_size, size_t capacity)
+{
+    struct coro_chan *ch = calloc(1, sizeof(*ch));
+    if (ch == NULL)
+        return NULL;
+    if (capacity > 0) {
+        ch->buf = malloc(elem_size * capacity);
+        if (ch->buf == NULL) {
+            free(ch);
+            return NULL;
+        }
+    }
+    ch->elem_size = elem_size;
+    ch->capacity = capacity;
+    pthread_mutex_init(&ch->lock, NULL);
+    return ch;
+}
+
+void
+coro_chan_delete(struct coro_chan *ch)
+{
+    pthread_mutex_destroy(&ch->lock);
+    free(ch->buf);
+    free(ch);
+}
+
+static void
+coro_chan_buf_push(struct coro_chan *ch, const void *elem)
+{
+    size_t i = (ch->head + ch->count) % ch->capacity;
+    memcpy(ch->buf + i * ch->elem_size, elem, ch->elem_size);
+    ++ch->count;
+}
+
+static void
+coro_chan_buf_pop(struct coro_chan *ch, void *elem)
+{
+    memcpy(elem, ch->buf + ch->head * ch->elem_size, ch->elem_size);
+    ch->head = (ch->head + 1) % ch->capacity;
+    --ch->count;
+}
+
+int
+coro_chan_send(struct coro_chan *ch, const void *elem)
+{
+    pthread_mutex_lock(&ch->lock);
+    if (ch->is_closed) {
+        pthread_mutex_unlock(&ch->lock);
+        return -1;
+    }
+    /* A waiting receiver means the buffer is empty, give directly. */
+    struct coro_waiter *w = coro_wait_queue_pop(&ch->receivers);
+    if (w != NULL) {
+        memcpy(w->data, elem, ch->elem_size);
+        coro_waiter_wake(w, 0);
+        pthread_mutex_unlock(&ch->lock);
+        return 0;
+    }
+    if (ch->count < ch->capacity) {
+        coro_chan_buf_push(ch, elem);
+        pthread_mutex_unlock(&ch->lock);
+        return 0;
+    }
+    struct coro_waiter self;
+    coro_waiter_init(&self, (void *) elem);
+    coro_wait_queue_push(&ch->senders, &self);
+    return coro_waiter_park(&self, &ch->lock);
+}
+
+int
+coro_chan_recv(struct coro_chan *ch, void *elem)
+{
+    pthread_mutex_lock(&ch->lock);
+    struct coro_waiter *w;
+    if (ch->count > 0) {
+        coro_chan_buf_pop(ch, elem);
+        /* Room appeared - the first parked sender can go on. */
+        if ((w = coro_wait_queue_pop(&ch->senders)) != NULL) {
+            coro_chan_buf_push(ch, w->data);
+            coro_waiter_wake(w, 0);
+        }
+        pthread_mutex_unlock(&ch->lock);
+        return 0;
+    }
+    if ((w = coro_wait_queue_pop(&ch->senders)) != NULL) {
+        memcpy(elem, w->data, ch->elem_size);
+        coro_waiter_wake(w, 0);
+        pthread_mutex_unlock(&ch->lock);
+        return 0;
+    }
+    if (ch->is_closed) {
+        pthread_mutex_unlock(&ch->lock);
+        return -1;
+    }
+    struct coro_waiter self;
+    coro_waiter_init(&self, elem);
+    coro_wait_queue_push(&ch->receivers, &self);
+    return coro_waiter_park(&self, &ch->lock);
+}
+
+void
+coro_chan_close(struct coro_chan *ch)
+{
+    pthread_mutex_lock(&ch->lock);
+    ch->is_closed = true;
+    struct coro_waiter *w;
+    while ((w = coro_wait_queue_pop(&ch->senders)) != NULL)
+        coro_waiter_wake(w, -1);
+    while ((w = coro_wait_queue_pop(&ch->receivers)) != NULL)
+        coro_waiter_wake(w, -1);
+    pthread_mutex_unlock(&ch->lock);
+}
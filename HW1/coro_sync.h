@@ -0,0 +1,135 @@
+#ifndef CORO_SYNC_INCLUDED
+#define CORO_SYNC_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Synchronization primitives for coroutines. A blocking call parks
+ * the coroutine in a wait queue of the primitive, the scheduler
+ * runs others meanwhile and nobody spins in coro_yield(). All of
+ * them work in the M:N mode too. Called not from a coroutine, they
+ * block the thread, which is useful for the thread waiting in the
+ * M:N mode.
+ */
+
+struct coro_mutex;
+struct coro_cond;
+struct coro_wg;
+struct coro_chan;
+
+/** Mutex API. */
+
+/** Create an unlocked mutex. NULL, if no memory. */
+struct coro_mutex *
+coro_mutex_new(void);
+
+/** Delete a mutex. It must be unlocked and have no waiters. */
+void
+coro_mutex_delete(struct coro_mutex *m);
+
+/** Lock the mutex, park until it is free. */
+void
+coro_mutex_lock(struct coro_mutex *m);
+
+/** Lock the mutex, if it is free. True on success. */
+bool
+coro_mutex_trylock(struct coro_mutex *m);
+
+/**
+ * Unlock the mutex. If somebody waits for it, the ownership is
+ * handed over to the first waiter directly.
+ */
+void
+coro_mutex_unlock(struct coro_mutex *m);
+
+/** Condition variable API. */
+
+/** Create a condition variable. NULL, if no memory. */
+struct coro_cond *
+coro_cond_new(void);
+
+/** Delete a condition variable. It must have no waiters. */
+void
+coro_cond_delete(struct coro_cond *c);
+
+/**
+ * Unlock @a m, park until the condition is signaled and lock
+ * @a m again.
+ */
+void
+coro_cond_wait(struct coro_cond *c, struct coro_mutex *m);
+
+/** Wake up one waiter of the condition. */
+void
+coro_cond_signal(struct coro_cond *c);
+
+/** Wake up all the waiters of the condition. */
+void
+coro_cond_broadcast(struct coro_cond *c);
+
+/** Wait group API. */
+
+/** Create a wait group with zero counter. NULL, if no memory. */
+struct coro_wg *
+coro_wg_new(void);
+
+/** Delete a wait group. It must have no waiters. */
+void
+coro_wg_delete(struct coro_wg *wg);
+
+/**
+ * Add @a delta to the counter. When it drops to zero, all the
+ * waiters are woken up. A negative counter is a fatal error.
+ */
+void
+coro_wg_add(struct coro_wg *wg, int delta);
+
+/** Same as coro_wg_add(wg, -1). */
+void
+coro_wg_done(struct coro_wg *wg);
+
+/** Park until the counter is zero. */
+void
+coro_wg_wait(struct coro_wg *wg);
+
+/** Channel API. */
+
+/**
+ * Create a channel of elements of @a elem_size bytes, which can
+ * buffer up to @a capacity of them. With zero capacity a sender
+ * waits until a receiver takes its element. NULL, if no memory.
+ */
+struct coro_chan *
+coro_chan_new(size_t elem_size, size_t capacity);
+
+/** Delete a channel. It must have no waiters. */
+void
+coro_chan_delete(struct coro_chan *ch);
+
+/**
+ * Copy an element from @a elem into the channel. Park while the
+ * channel is full.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed.
+ */
+int
+coro_chan_send(struct coro_chan *ch, const void *elem);
+
+/**
+ * Take an element from the channel into @a elem. Park while the
+ * channel is empty.
+ * @retval 0 Success.
+ * @retval -1 The channel is closed and has no more elements.
+ */
+int
+coro_chan_recv(struct coro_chan *ch, void *elem);
+
+/**
+ * Close the channel. Parked senders fail, receivers get what is
+ * buffered and then fail.
+ */
+void
+coro_chan_close(struct coro_chan *ch);
+
+#endif /* CORO_SYNC_INCLUDED */
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include "libcoro.h"
+#include "coro_int.h"
+
+/**
+ * Ring buffer of the scheduler trace. Every coroutine turn on a
+ * scheduler is one event. When the ring is full, the oldest events
+ * are overwritten. Writers from different M:N workers only share
+ * the atomic position.
+ */
+
+/** One coroutine turn. */
+struct coro_trace_event {
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t coro_id;
+    int thread_id;
+    enum coro_trace_reason reason;
+};
+
+static struct coro_trace_event *trace_ring = NULL;
+static size_t trace_capacity = 0;
+/** How many events were ever written since the start. */
+static atomic_size_t trace_pos;
+static atomic_bool trace_is_on;
+
+bool
+coro_trace_is_on(void)
+{
+    return atomic_load_explicit(&trace_is_on, memory_order_relaxed);
+}
+
+void
+coro_trace_slice(uint64_t coro_id, int thread_id, uint64_t start_ns,
+                 uint64_t duration_ns, enum coro_trace_reason reason)
+{
+    size_t pos = atomic_fetch_add_explicit(&trace_pos, 1,
+                                           memory_order_relaxed);
+    struct coro_trace_event *e = &trace_ring[pos % trace_capacity];
+    e->start_ns = start_ns;
+    e->duration_ns = duration_ns;
+    e->coro_id = coro_id;
+    e->thread_id = thread_id;
+    e->reason = reason;
+}
+
+int
+coro_trace_start(size_t capacity)
+{
+    if (capacity == 0 || coro_trace_is_on())
+        return -1;
+    struct coro_trace_event *ring = calloc(capacity, sizeof(*ring));
+    if (ring == NULL)
+        return -1;
+    free(trace_ring);
+    trace_ring = ring;
+    trace_capacity = capacity;
+    atomic_store(&trace_pos, 0);
+    atomic_store(&trace_is_on, true);
+    return 0;
+}
+
+void
+coro_trace_stop(void)
+{
+    atomic_store(&trace_is_on, false);
+}
+
+static const char *
+coro_trace_reason_str(enum coro_trace_reason reason)
+{
+    switch (reason) {
+    case CORO_TRACE_YIELD:
+        return "yield";
+    case CORO_TRACE_PARK:
+        return "park";
+    case CORO_TRACE_FINISH:
+        return "finish";
+    }
+    return "unknown";
+}
+
+int
+coro_trace_dump(const char *path)
+{
+    if (trace_ring == NULL)
+        return -1;
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return -1;
+    size_t end = atomic_load(&trace_pos);
+    size_t begin = end > trace_capacity ? end - trace_capacity : 0;
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (size_t i = begin; i < end; i++) {
+        const struct coro_trace_event *e = &trace_ring[i % trace_capacity];
+        fprintf(file, "%s{\"name\":\"coro %llu\",\"cat\":\"coro\","
+                "\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                "\"dur\":%.3f,\"args\":{\"end\":\"%s\"}}",
+                i == begin ? "" : ",\n", (unsigned long long) e->coro_id,
+                e->thread_id, e->start_ns / 1000.0, e->duration_ns / 1000.0,
+                coro_trace_reason_str(e->reason));
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
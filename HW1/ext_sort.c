@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "libcoro.h"
+#include "ext_sort.h"
+#include "merge.h"
+#include "int_io.h"
+
+struct ext_sort {
+    size_t budget;
+    /** How many integers fit into the run buffer of one worker. */
+    size_t run_size;
+    ext_sort_f sort;
+    const char *tmp_dir;
+    /** Protects the run list and the counter. */
+    pthread_mutex_t lock;
+    /** Spilled runs - descriptors of unlinked temporary files. */
+    int *runs;
+    int run_count;
+    int run_capacity;
+    long long count;
+};
+
+/** Buffered reader of a run in the merge. */
+struct ext_run_reader {
+    struct merge_source base;
+    int fd;
+    int *buf;
+    size_t size;
+};
+
+/** Destination of a merge: a new run or the text output. */
+struct ext_sink {
+    /** Binary run descriptor, -1 for the text output. */
+    int fd;
+    struct int_writer *writer;
+};
+
+struct ext_sort *
+ext_sort_new(size_t budget, int worker_count, ext_sort_f sort)
+{
+    if (worker_count <= 0 ||
+        budget / worker_count < 2 * EXT_SORT_CHUNK_SIZE ||
+        budget < 3 * EXT_SORT_MIN_BUF_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct ext_sort *es = calloc(1, sizeof(*es));
+    if (es == NULL)
+        return NULL;
+    es->budget = budget;
+    es->run_size = (budget / worker_count - EXT_SORT_CHUNK_SIZE) /
+                   sizeof(int);
+    es->sort = sort;
+    es->tmp_dir = getenv("TMPDIR");
+    if (es->tmp_dir == NULL || *es->tmp_dir == '\0')
+        es->tmp_dir = "/tmp";
+    pthread_mutex_init(&es->lock, NULL);
+    return es;
+}
+
+void
+ext_sort_delete(struct ext_sort *es)
+{
+    for (int i = 0; i < es->run_count; i++)
+        close(es->runs[i]);
+    free(es->runs);
+    pthread_mutex_destroy(&es->lock);
+    free(es);
+}
+
+long long
+ext_sort_count(const struct ext_sort *es)
+{
+    return es->count;
+}
+
+int
+ext_sort_run_count(const struct ext_sort *es)
+{
+    return es->run_count;
+}
+
+/**
+ * Create a temporary file. It is unlinked at once, so it
+ * disappears with the descriptor even if the process crashes.
+ */
+static int
+ext_sort_tmp_file(struct ext_sort *es)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/ext_sort.XXXXXX", es->tmp_dir);
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+    return fd;
+}
+
+static int
+ext_write_all(int fd, const void *data, size_t size)
+{
+    const char *pos = data;
+    while (size > 0) {
+        ssize_t n = write(fd, pos, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/**
+ * Append a run to the run list. Its numbers start at @a offset of
+ * the file.
+ */
+static int
+ext_sort_add_run(struct ext_sort *es, int fd, off_t offset)
+{
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    pthread_mutex_lock(&es->lock);
+    if (es->run_count == es->run_capacity) {
+        int capacity = es->run_capacity == 0 ? 16 : es->run_capacity * 2;
+        int *runs = realloc(es->runs, capacity * sizeof(*runs));
+        if (runs == NULL) {
+            pthread_mutex_unlock(&es->lock);
+            return -1;
+        }
+        es->runs = runs;
+        es->run_capacity = capacity;
+    }
+    es->runs[es->run_count++] = fd;
+    pthread_mutex_unlock(&es->lock);
+    return 0;
+}
+
+/** Sort a run buffer and spill it into a new temporary file. */
+static int
+ext_sort_spill(struct ext_sort *es, int *arr, size_t count)
+{
+    es->sort(arr, count);
+    int fd = ext_sort_tmp_file(es);
+    if (fd < 0)
+        return -1;
+    if (ext_write_all(fd, arr, count * sizeof(int)) != 0 ||
+        ext_sort_add_run(es, fd, 0) != 0) {
+        int save_errno = errno;
+        close(fd);
+        errno = save_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Add a binary file. A sorted one becomes a run as is, an unsorted
+ * one is read by run buffers. @a fd is not closed.
+ */
+static int
+ext_sort_add_bin(struct ext_sort *es, int fd,
+                 const struct int_bin_header *header)
+{
+    if (header->flags & INT_BIN_SORTED) {
+        if (ext_sort_add_run(es, fd, sizeof(*header)) != 0)
+            return -1;
+        pthread_mutex_lock(&es->lock);
+        es->count += header->count;
+        pthread_mutex_unlock(&es->lock);
+        return 0;
+    }
+    int *run = malloc(es->run_size * sizeof(int));
+    if (run == NULL)
+        return -1;
+    off_t offset = sizeof(*header);
+    size_t left = header->count;
+    int rc = 0;
+    while (left > 0 && rc == 0) {
+        size_t count = left < es->run_size ? left : es->run_size;
+        size_t size = count * sizeof(int), done = 0;
+        while (done < size) {
+            ssize_t n = pread(fd, (char *) run + done, size - done,
+                              offset + done);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n == 0)
+                    errno = EINVAL;
+                rc = -1;
+                break;
+            }
+            done += n;
+        }
+        if (rc == 0)
+            rc = ext_sort_spill(es, run, count);
+        offset += size;
+        left -= count;
+    }
+    if (rc == 0) {
+        pthread_mutex_lock(&es->lock);
+        es->count += header->count;
+        pthread_mutex_unlock(&es->lock);
+    }
+    free(run);
+    return rc;
+}
+
+int
+ext_sort_add_file(struct ext_sort *es, const char *path,
+                  off_t *error_offset)
+{
+    *error_offset = -1;
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return -1;
+    struct int_bin_header header;
+    if (int_bin_read_header(fd, &header) == 0) {
+        int rc = ext_sort_add_bin(es, fd, &header);
+        /* A sorted file has become a run, the run list owns it. */
+        if (rc != 0 || (header.flags & INT_BIN_SORTED) == 0) {
+            int save_errno = errno;
+            close(fd);
+            errno = save_errno;
+        }
+        return rc;
+    }
+    int *run = malloc(es->run_size * sizeof(int));
+    char *chunk = malloc(EXT_SORT_CHUNK_SIZE);
+    if (run == NULL || chunk == NULL) {
+        free(run);
+        free(chunk);
+        close(fd);
+        return -1;
+    }
+    size_t len = 0, count = 0;
+    /* File offset of the chunk beginning. */
+    off_t offset = 0;
+    /* Only the spilled numbers are counted. */
+    long long total = 0;
+    bool is_eof = false;
+    bool is_parse_error = false;
+    int rc = 0;
+    while (! is_eof && rc == 0) {
+        ssize_t n = coro_read(fd, chunk + len, EXT_SORT_CHUNK_SIZE - len);
+        if (n < 0) {
+            rc = -1;
+            break;
+        }
+        is_eof = n == 0;
+        len += n;
+        /* A number cut by the chunk end waits for the next read. */
+        size_t end = len;
+        if (! is_eof) {
+            while (end > 0 && ! isspace((unsigned char) chunk[end - 1]))
+                --end;
+            if (end == 0) {
+                if (len < EXT_SORT_CHUNK_SIZE)
+                    continue;
+                is_parse_error = true;
+                rc = -1;
+                break;
+            }
+        }
+        const char *current = chunk;
+        while (current < chunk + end) {
+            size_t n;
+            if (int_parse(&current, chunk + end, run + count,
+                          es->run_size - count, &n) != 0) {
+                *error_offset = offset + (current - chunk);
+                is_parse_error = true;
+                rc = -1;
+            }
+            count += n;
+            if (rc != 0)
+                break;
+            if (count == es->run_size) {
+                if (ext_sort_spill(es, run, count) != 0) {
+                    rc = -1;
+                    break;
+                }
+                total += count;
+                count = 0;
+            }
+        }
+        memmove(chunk, chunk + end, len - end);
+        len -= end;
+        offset += end;
+    }
+    /* The numbers before a parse error are kept as the last run. */
+    if ((rc == 0 || is_parse_error) && count > 0) {
+        if (ext_sort_spill(es, run, count) == 0) {
+            total += count;
+        } else {
+            rc = -1;
+            is_parse_error = false;
+        }
+    }
+    if (is_parse_error)
+        errno = EINVAL;
+    pthread_mutex_lock(&es->lock);
+    es->count += total;
+    pthread_mutex_unlock(&es->lock);
+    free(chunk);
+    free(run);
+    close(fd);
+    return rc;
+}
+
+/** Read the next portion of the run. Empty at the end. */
+static int
+ext_run_reader_next(struct merge_source *base)
+{
+    struct ext_run_reader *r = (struct ext_run_reader *) base;
+    char *buf = (char *) r->buf;
+    size_t size = r->size * sizeof(int), done = 0;
+    while (done < size) {
+        ssize_t n = read(r->fd, buf + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        done += n;
+    }
+    r->base.pos = r->buf;
+    r->base.end = r->buf + done / sizeof(int);
+    return 0;
+}
+
+static int
+ext_sink_write(void *ctx, const int *batch, size_t count)
+{
+    struct ext_sink *sink = ctx;
+    if (sink->fd >= 0)
+        return ext_write_all(sink->fd, batch, count * sizeof(int));
+    return int_writer_write(sink->writer, batch, count);
+}
+
+/**
+ * Merge @a count runs into @a sink. @a budget bytes are split evenly
+ * between the readers and the output batch.
+ */
+static int
+ext_sort_merge(const int *fds, int count, size_t budget,
+               struct ext_sink *sink)
+{
+    size_t share = budget / (count + 1) / sizeof(int);
+    struct ext_run_reader *readers = calloc(count, sizeof(*readers));
+    struct merge_source **srcs = calloc(count, sizeof(*srcs));
+    int *bufs = malloc(share * (count + 1) * sizeof(int));
+    int rc = -1;
+    if (readers == NULL || srcs == NULL || bufs == NULL)
+        goto out;
+    for (int i = 0; i < count; i++) {
+        struct ext_run_reader *r = &readers[i];
+        r->fd = fds[i];
+        r->buf = bufs + share * i;
+        r->size = share;
+        r->base.next = ext_run_reader_next;
+        if (ext_run_reader_next(&r->base) != 0)
+            goto out;
+        srcs[i] = &r->base;
+    }
+    rc = merge_k(srcs, count, bufs + share * count, share,
+                 ext_sink_write, sink);
+out:
+    free(bufs);
+    free(srcs);
+    free(readers);
+    return rc;
+}
+
+int
+ext_sort_finish(struct ext_sort *es, const char *output,
+                enum int_format format)
+{
+    int fan_in = (int) (es->budget / EXT_SORT_MIN_BUF_SIZE) - 1;
+    /* The last pass takes one more share for the output writer. */
+    int last_fan_in = fan_in - 1;
+    /*
+     * Too many runs for one pass - merge the oldest ones into a
+     * bigger run until the rest fits.
+     */
+    while (es->run_count > last_fan_in) {
+        int n = es->run_count < fan_in ? es->run_count : fan_in;
+        struct ext_sink sink = {.fd = ext_sort_tmp_file(es)};
+        if (sink.fd < 0)
+            return -1;
+        if (ext_sort_merge(es->runs, n, es->budget, &sink) != 0) {
+            close(sink.fd);
+            return -1;
+        }
+        for (int i = 0; i < n; i++)
+            close(es->runs[i]);
+        es->run_count -= n;
+        memmove(es->runs, es->runs + n,
+                es->run_count * sizeof(*es->runs));
+        if (ext_sort_add_run(es, sink.fd, 0) != 0) {
+            close(sink.fd);
+            return -1;
+        }
+    }
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    /* The writer buffer is a share of the budget like a reader one. */
+    size_t writer_size = es->budget / (es->run_count + 2);
+    struct int_writer writer;
+    if ((format == INT_FORMAT_BIN &&
+         int_bin_write_header(fd, es->count, true) != 0) ||
+        int_writer_create(&writer, fd, format, writer_size) != 0) {
+        close(fd);
+        return -1;
+    }
+    struct ext_sink sink = {.fd = -1, .writer = &writer};
+    int rc = ext_sort_merge(es->runs, es->run_count,
+                            es->budget - writer_size, &sink);
+    if (rc == 0)
+        rc = int_writer_flush(&writer);
+    int_writer_destroy(&writer);
+    if (close(fd) != 0)
+        rc = -1;
+    return rc;
+}
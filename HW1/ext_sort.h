@@ -0,0 +1,73 @@
+#ifndef EXT_SORT_INCLUDED
+#define EXT_SORT_INCLUDED
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "int_io.h"
+
+/**
+ * External merge sort of integer files with a memory budget.
+ * Coroutines read input files into bounded run buffers, sort each
+ * full buffer and spill it into an unlinked temporary file. Then
+ * the runs are merged by a streaming k-way merge, in several
+ * passes if there are too many of them for the budget. Memory use
+ * does not depend on the input size.
+ */
+
+struct ext_sort;
+
+/** Sort @a count integers of a run in place. */
+typedef void (*ext_sort_f)(int *arr, size_t count);
+
+enum {
+    /** Read chunk of a text input file. */
+    EXT_SORT_CHUNK_SIZE = 64 * 1024,
+    /** Smallest buffer of one run in the merge. */
+    EXT_SORT_MIN_BUF_SIZE = 64 * 1024,
+};
+
+/**
+ * Create a sorter. @a budget bytes are shared by the run buffers
+ * of @a worker_count coroutines, which add files at the same time,
+ * and later by the merge and output buffers. Runs are sorted by @a sort.
+ * Temporary files go to $TMPDIR or /tmp. NULL, if the budget is too
+ * small or no memory.
+ */
+struct ext_sort *
+ext_sort_new(size_t budget, int worker_count, ext_sort_f sort);
+
+/** Delete the sorter and close its runs. */
+void
+ext_sort_delete(struct ext_sort *es);
+
+/**
+ * Read a file of integers, text or binary, and spill it as sorted
+ * runs. A sorted binary file is used as a run itself, without a
+ * copy. Called from a coroutine it parks on a slow pipe.
+ * Can be called from several coroutines, up to the worker count.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EINVAL means a parse error at
+ *         @a error_offset, the numbers before it are added.
+ */
+int
+ext_sort_add_file(struct ext_sort *es, const char *path,
+                  off_t *error_offset);
+
+/**
+ * Merge all the runs into the file @a output of @a format.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+ext_sort_finish(struct ext_sort *es, const char *output,
+                enum int_format format);
+
+/** How many integers were added. */
+long long
+ext_sort_count(const struct ext_sort *es);
+
+/** How many runs were spilled. */
+int
+ext_sort_run_count(const struct ext_sort *es);
+
+#endif /* EXT_SORT_INCLUDED */
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "libcoro.h"
+#include "int_io.h"
+
+// convert integer files between the text and the binary formats of the sort pipeline
+// usage: int_conv -b input.txt output.bin - text to binary, the sorted flag is set if the numbers are sorted
+//        int_conv -t input.bin output.txt - binary to text
+int main(int argc, char *argv[]) {
+    if (argc != 4 || (strcmp(argv[1], "-b") != 0 && strcmp(argv[1], "-t") != 0)) {
+        printf("Usage: %s -b|-t input output\n", argv[0]);
+        return 1;
+    }
+    enum int_format format = strcmp(argv[1], "-b") == 0 ? INT_FORMAT_BIN : INT_FORMAT_TEXT;
+
+    // read input of any format
+    int *data = NULL;
+    size_t count = 0;
+    struct int_bin_map map = {.map = NULL};
+    if (int_file_is_bin(argv[2])) {
+        if (int_bin_map(argv[2], &map) != 0) {
+            printf("Can not read %s: %s\n", argv[2], strerror(errno));
+            return 1;
+        }
+        data = map.data;
+        count = map.count;
+    } else {
+        off_t error_offset;
+        if (int_file_read(argv[2], &data, &count, &error_offset) != 0) {
+            if (errno == EINVAL) {
+                printf("%s: not a number at offset %lld\n", argv[2], (long long) error_offset);
+            } else {
+                printf("Can not read %s: %s\n", argv[2], strerror(errno));
+            }
+            free(data);
+            return 1;
+        }
+    }
+
+    // write output
+    int rc = 0;
+    int fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct int_writer writer;
+    if (fd < 0) {
+        rc = 1;
+    } else if (format == INT_FORMAT_BIN) {
+        int is_sorted = 1;
+        for (size_t i = 1; i < count && is_sorted; i++) {
+            is_sorted = data[i - 1] <= data[i];
+        }
+        if (int_bin_write_header(fd, count, is_sorted) != 0) rc = 1;
+    }
+    if (rc == 0) {
+        if (int_writer_create(&writer, fd, format, INT_WRITER_BUF_SIZE) != 0) {
+            rc = 1;
+        } else {
+            if (int_writer_write(&writer, data, count) != 0 || int_writer_flush(&writer) != 0) rc = 1;
+            int_writer_destroy(&writer);
+        }
+    }
+    if (fd >= 0 && close(fd) != 0) rc = 1;
+    if (rc != 0) {
+        printf("Can not write %s: %s\n", argv[3], strerror(errno));
+    }
+
+    if (map.map != NULL) {
+        int_bin_unmap(&map);
+    } else {
+        free(data);
+    }
+    return rc;
+}
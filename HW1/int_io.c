@@ -0,0 +1,402 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libcoro.h"
+#include "int_io.h"
+
+static inline bool
+int_is_space(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool
+int_is_digit(char c)
+{
+    return (unsigned char) (c - '0') < 10;
+}
+
+/** True, if all 8 bytes of @a chunk are ASCII digits. */
+static inline bool
+int_is_8_digits(uint64_t chunk)
+{
+    return ((chunk & 0xF0F0F0F0F0F0F0F0) |
+            (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) ==
+           0x3333333333333333;
+}
+
+/**
+ * Value of 8 ASCII digits, the first one in the lowest byte. Pairs
+ * of digits are combined, then pairs of pairs, in 3 multiplies.
+ */
+static inline uint64_t
+int_parse_8_digits(uint64_t chunk)
+{
+    chunk = ((chunk & 0x0F0F0F0F0F0F0F0F) * 2561) >> 8;
+    chunk = ((chunk & 0x00FF00FF00FF00FF) * 6553601) >> 16;
+    return ((chunk & 0x0000FFFF0000FFFF) * 42949672960001) >> 32;
+}
+
+int
+int_parse(const char **pos, const char *end, int *out, size_t max,
+          size_t *count)
+{
+    const char *p = *pos;
+    size_t n = 0;
+    int rc = 0;
+    while (n < max) {
+        while (p < end && int_is_space(*p))
+            ++p;
+        if (p == end)
+            break;
+        const char *start = p;
+        bool is_neg = false;
+        if (*p == '-' || *p == '+')
+            is_neg = *p++ == '-';
+        const char *digits = p;
+        uint64_t value = 0;
+        if (end - p >= 8) {
+            uint64_t chunk;
+            memcpy(&chunk, p, sizeof(chunk));
+            if (int_is_8_digits(chunk)) {
+                value = int_parse_8_digits(chunk);
+                p += 8;
+            }
+        }
+        /* Saturate above int32, so long numbers do not wrap. */
+        for (; p < end && int_is_digit(*p); ++p) {
+            if (value <= UINT32_MAX)
+                value = value * 10 + (*p - '0');
+        }
+        if (p == digits || (p < end && ! int_is_space(*p)) ||
+            value > (is_neg ? (uint64_t) INT32_MAX + 1 : INT32_MAX)) {
+            p = start;
+            rc = -1;
+            break;
+        }
+        out[n++] = is_neg ? (int) -(int64_t) value : (int) value;
+    }
+    *pos = p;
+    *count = n;
+    return rc;
+}
+
+/** Parse the whole text into a new array, growing it by doubling. */
+static int
+int_parse_all(const char *text, size_t len, int **data, size_t *count,
+              off_t *error_offset)
+{
+    /*
+     * A number with its separator takes at least 2 bytes, but the
+     * len / 2 bound would waste most of the array on usual numbers.
+     * It starts from a guess of 8 bytes a number and grows instead.
+     */
+    size_t capacity = len / 8 + 16, size = 0;
+    int *arr = malloc(capacity * sizeof(int));
+    if (arr == NULL)
+        return -1;
+    const char *pos = text, *end = text + len;
+    int rc = 0;
+    while (pos < end) {
+        size_t n;
+        rc = int_parse(&pos, end, arr + size, capacity - size, &n);
+        size += n;
+        if (rc != 0) {
+            *error_offset = pos - text;
+            errno = EINVAL;
+            break;
+        }
+        if (size < capacity)
+            break;
+        capacity *= 2;
+        int *new_arr = realloc(arr, capacity * sizeof(int));
+        if (new_arr == NULL) {
+            free(arr);
+            return -1;
+        }
+        arr = new_arr;
+    }
+    *data = arr;
+    *count = size;
+    return rc;
+}
+
+/** Read everything from a descriptor, which can not be mapped. */
+static char *
+int_read_all(int fd, size_t *len)
+{
+    size_t capacity = 64 * 1024, size = 0;
+    char *text = malloc(capacity);
+    if (text == NULL)
+        return NULL;
+    ssize_t n;
+    while ((n = coro_read(fd, text + size, capacity - size)) > 0) {
+        size += n;
+        if (size < capacity)
+            continue;
+        capacity *= 2;
+        char *new_text = realloc(text, capacity);
+        if (new_text == NULL) {
+            free(text);
+            return NULL;
+        }
+        text = new_text;
+    }
+    if (n < 0) {
+        free(text);
+        return NULL;
+    }
+    *len = size;
+    return text;
+}
+
+int
+int_file_read(const char *path, int **data, size_t *count,
+              off_t *error_offset)
+{
+    *data = NULL;
+    *count = 0;
+    *error_offset = -1;
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    int rc;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t len = st.st_size;
+        void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED)
+            return -1;
+        madvise(map, len, MADV_SEQUENTIAL);
+        rc = int_parse_all(map, len, data, count, error_offset);
+        int save_errno = errno;
+        munmap(map, len);
+        errno = save_errno;
+        return rc;
+    }
+    size_t len = 0;
+    char *text = int_read_all(fd, &len);
+    int save_errno = errno;
+    close(fd);
+    if (text == NULL) {
+        errno = save_errno;
+        return -1;
+    }
+    rc = int_parse_all(text, len, data, count, error_offset);
+    save_errno = errno;
+    free(text);
+    errno = save_errno;
+    return rc;
+}
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The binary format is mapped as is, a little-endian host is needed"
+#endif
+
+int
+int_bin_read_header(int fd, struct int_bin_header *header)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -1;
+    if (! S_ISREG(st.st_mode) || (size_t) st.st_size < sizeof(*header)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header))
+        return -1;
+    if (header->magic != INT_BIN_MAGIC ||
+        header->count != (st.st_size - sizeof(*header)) / sizeof(int32_t) ||
+        (st.st_size - sizeof(*header)) % sizeof(int32_t) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+bool
+int_file_is_bin(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0)
+        return false;
+    struct int_bin_header header;
+    bool ok = int_bin_read_header(fd, &header) == 0;
+    close(fd);
+    return ok;
+}
+
+int
+int_bin_map(const char *path, struct int_bin_map *m)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct int_bin_header header;
+    if (int_bin_read_header(fd, &header) != 0) {
+        int save_errno = errno;
+        close(fd);
+        errno = save_errno;
+        return -1;
+    }
+    size_t size = sizeof(header) + header.count * sizeof(int32_t);
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                     fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, size, MADV_SEQUENTIAL);
+    m->map = map;
+    m->map_size = size;
+    m->data = (int *) ((char *) map + sizeof(header));
+    m->count = header.count;
+    m->is_sorted = (header.flags & INT_BIN_SORTED) != 0;
+    return 0;
+}
+
+void
+int_bin_unmap(struct int_bin_map *m)
+{
+    munmap(m->map, m->map_size);
+    m->map = NULL;
+    m->data = NULL;
+}
+
+/** write(2) all of @a size bytes. */
+static int
+int_write_all(int fd, const void *data, size_t size)
+{
+    const char *pos = data;
+    while (size > 0) {
+        ssize_t n = write(fd, pos, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        pos += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int
+int_bin_write_header(int fd, size_t count, bool is_sorted)
+{
+    struct int_bin_header header = {
+        .magic = INT_BIN_MAGIC,
+        .flags = is_sorted ? INT_BIN_SORTED : 0,
+        .count = count,
+    };
+    return int_write_all(fd, &header, sizeof(header));
+}
+
+int
+int_writer_create(struct int_writer *w, int fd, enum int_format format,
+                  size_t size)
+{
+    w->buf = malloc(size);
+    if (w->buf == NULL)
+        return -1;
+    w->format = format;
+    w->fd = fd;
+    w->size = size;
+    w->len = 0;
+    return 0;
+}
+
+void
+int_writer_destroy(struct int_writer *w)
+{
+    free(w->buf);
+    w->buf = NULL;
+}
+
+int
+int_writer_flush(struct int_writer *w)
+{
+    size_t len = w->len;
+    w->len = 0;
+    return int_write_all(w->fd, w->buf, len);
+}
+
+/** "00" .. "99", to format two digits at a time. */
+static const char int_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930"
+    "31323334353637383940414243444546474849505152535455565758596061"
+    "6263646566676869707172737475767778798081828384858687888990919293"
+    "949596979899";
+
+/** Format @a value and a space at @a p. Return the end. */
+static inline char *
+int_format(char *p, int value)
+{
+    uint32_t u = (uint32_t) value;
+    if (value < 0) {
+        *p++ = '-';
+        u = 0 - u;
+    }
+    char tmp[10];
+    char *t = tmp + sizeof(tmp);
+    while (u >= 100) {
+        t -= 2;
+        memcpy(t, &int_digit_pairs[(u % 100) * 2], 2);
+        u /= 100;
+    }
+    if (u >= 10) {
+        t -= 2;
+        memcpy(t, &int_digit_pairs[u * 2], 2);
+    } else {
+        *--t = '0' + u;
+    }
+    size_t len = tmp + sizeof(tmp) - t;
+    memcpy(p, t, len);
+    p[len] = ' ';
+    return p + len + 1;
+}
+
+enum {
+    /** Longest formatted int32 with the space: "-2147483648 ". */
+    INT_FORMAT_MAX = 12,
+};
+
+int
+int_writer_write(void *ctx, const int *arr, size_t count)
+{
+    struct int_writer *w = ctx;
+    if (w->format == INT_FORMAT_BIN) {
+        while (count > 0) {
+            size_t n = (w->size - w->len) / sizeof(int);
+            if (n == 0) {
+                if (int_writer_flush(w) != 0)
+                    return -1;
+                continue;
+            }
+            if (n > count)
+                n = count;
+            memcpy(w->buf + w->len, arr, n * sizeof(int));
+            w->len += n * sizeof(int);
+            arr += n;
+            count -= n;
+        }
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (w->size - w->len < INT_FORMAT_MAX &&
+            int_writer_flush(w) != 0)
+            return -1;
+        w->len = int_format(w->buf + w->len, arr[i]) - w->buf;
+    }
+    return 0;
+}
@@ -0,0 +1,154 @@
+#ifndef INT_IO_INCLUDED
+#define INT_IO_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Integer input and output of the sort pipeline. Text format is
+ * whitespace separated decimal int32 numbers, parsed without the
+ * locale and stdio, eight digits at a time, and formatted into a
+ * big buffer written by write(2).
+ *
+ * Binary format is a header and little-endian int32 numbers right
+ * after it. Such files are mapped and used as arrays directly,
+ * with no parsing and no copy.
+ */
+
+/**
+ * Parse integers from [*pos, end) into @a out, at most @a max of
+ * them. A number must not be cut at @a end. *pos is moved past the
+ * parsed numbers, @a count is set to how many were stored.
+ * @retval 0 Success - *pos is at the end or @a max numbers stored.
+ * @retval -1 Not a number or out of int32 range, *pos is at the
+ *         start of the bad token.
+ */
+int
+int_parse(const char **pos, const char *end, int *out, size_t max,
+          size_t *count);
+
+/**
+ * Read the whole file of integers into a new malloc'ed array.
+ * Regular files are mapped with mmap(), others - pipes, FIFOs -
+ * are read with coro_read(), so a coroutine parks on them.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EINVAL means a parse error at
+ *         @a error_offset, the numbers before it are returned.
+ */
+int
+int_file_read(const char *path, int **data, size_t *count,
+              off_t *error_offset);
+
+/** Header of a binary file. */
+struct int_bin_header {
+    /** INT_BIN_MAGIC. */
+    uint32_t magic;
+    /** INT_BIN_* flags. */
+    uint32_t flags;
+    /** How many numbers follow the header. */
+    uint64_t count;
+};
+
+enum {
+    /** "IBIN" in the file. */
+    INT_BIN_MAGIC = 0x4e494249,
+    /** The numbers are sorted in ascending order. */
+    INT_BIN_SORTED = 1,
+};
+
+/** Binary file mapped into memory. */
+struct int_bin_map {
+    /** The numbers, right in the mapping. */
+    int *data;
+    size_t count;
+    bool is_sorted;
+    void *map;
+    size_t map_size;
+};
+
+/**
+ * Check whether @a fd is a regular file in the binary format and
+ * read its header. The file offset is not changed.
+ * @retval 0 A binary file, @a header is filled.
+ * @retval -1 Not a binary file or an error.
+ */
+int
+int_bin_read_header(int fd, struct int_bin_header *header);
+
+/** True, if @a path is a regular file in the binary format. */
+bool
+int_file_is_bin(const char *path);
+
+/**
+ * Map a binary file. The mapping is private and writable, so the
+ * numbers can be sorted in place - changed pages are copied, the
+ * file stays intact.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set. EINVAL means a bad header.
+ */
+int
+int_bin_map(const char *path, struct int_bin_map *m);
+
+/** Unmap a mapped binary file. */
+void
+int_bin_unmap(struct int_bin_map *m);
+
+/** Output formats of a writer. */
+enum int_format {
+    INT_FORMAT_TEXT,
+    /** The header must be written before the numbers. */
+    INT_FORMAT_BIN,
+};
+
+/**
+ * Write a binary file header of @a count numbers at the current
+ * offset of @a fd.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+int_bin_write_header(int fd, size_t count, bool is_sorted);
+
+/** Buffered output of integers into a descriptor. */
+struct int_writer {
+    enum int_format format;
+    int fd;
+    char *buf;
+    size_t size;
+    size_t len;
+};
+
+enum {
+    /** Default output buffer size. */
+    INT_WRITER_BUF_SIZE = 1024 * 1024,
+};
+
+/**
+ * Create a writer into @a fd with a buffer of @a size bytes.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+int
+int_writer_create(struct int_writer *w, int fd, enum int_format format,
+                  size_t size);
+
+/**
+ * Write @a count integers. In the text format each of them is
+ * followed by a space. Fits merge_sink_f, @a ctx is the writer.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int
+int_writer_write(void *ctx, const int *arr, size_t count);
+
+/** Write out the buffered text. 0 on success, -1 on error. */
+int
+int_writer_flush(struct int_writer *w);
+
+/** Free the buffer. The descriptor is not closed. */
+void
+int_writer_destroy(struct int_writer *w);
+
+#endif /* INT_IO_INCLUDED */
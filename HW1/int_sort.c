@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "int_sort.h"
+
+enum {
+    /** How many elements the radix sort moves between yields. */
+    INT_SORT_YIELD_STEP = 16 * 1024,
+    /**
+     * Explicit stack depth of the introsort. The bigger half is
+     * always pushed, so log2 of the size is enough.
+     */
+    INT_SORT_STACK_SIZE = 64,
+};
+
+static inline void
+int_sort_yield(int_sort_yield_f yield)
+{
+    if (yield != NULL)
+        yield();
+}
+
+static inline void
+int_swap(int *a, int *b)
+{
+    int t = *a;
+    *a = *b;
+    *b = t;
+}
+
+/** The sign bit is flipped, so negative numbers go first. */
+static inline uint32_t
+int_sort_key(int value)
+{
+    return (uint32_t) value ^ 0x80000000u;
+}
+
+void
+int_sort_radix(int *arr, size_t n, int *tmp, int_sort_yield_f yield)
+{
+    if (n < 2)
+        return;
+    size_t counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < n; i++) {
+        uint32_t key = int_sort_key(arr[i]);
+        ++counts[0][key & 0xff];
+        ++counts[1][(key >> 8) & 0xff];
+        ++counts[2][(key >> 16) & 0xff];
+        ++counts[3][key >> 24];
+    }
+    int *src = arr, *dst = tmp;
+    for (int pass = 0; pass < 4; pass++) {
+        size_t *count = counts[pass];
+        int shift = pass * 8;
+        /* All the elements have the same digit - nothing to move. */
+        if (count[(int_sort_key(src[0]) >> shift) & 0xff] == n)
+            continue;
+        size_t offset = 0;
+        for (int d = 0; d < 256; d++) {
+            size_t c = count[d];
+            count[d] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            uint32_t digit = (int_sort_key(src[i]) >> shift) & 0xff;
+            dst[count[digit]++] = src[i];
+            if ((i + 1) % INT_SORT_YIELD_STEP == 0)
+                int_sort_yield(yield);
+        }
+        int *t = src;
+        src = dst;
+        dst = t;
+        int_sort_yield(yield);
+    }
+    if (src != arr)
+        memcpy(arr, src, n * sizeof(int));
+}
+
+static void
+int_sort_insertion(int *arr, size_t n)
+{
+    for (size_t i = 1; i < n; i++) {
+        int value = arr[i];
+        size_t j = i;
+        for (; j > 0 && arr[j - 1] > value; j--)
+            arr[j] = arr[j - 1];
+        arr[j] = value;
+    }
+}
+
+static void
+int_sort_sift_down(int *arr, size_t root, size_t n)
+{
+    for (;;) {
+        size_t child = 2 * root + 1;
+        if (child >= n)
+            return;
+        if (child + 1 < n && arr[child + 1] > arr[child])
+            ++child;
+        if (arr[root] >= arr[child])
+            return;
+        int_swap(&arr[root], &arr[child]);
+        root = child;
+    }
+}
+
+static void
+int_sort_heap(int *arr, size_t n, int_sort_yield_f yield)
+{
+    for (size_t i = n / 2; i > 0; i--)
+        int_sort_sift_down(arr, i - 1, n);
+    for (size_t end = n - 1; end > 0; end--) {
+        int_swap(&arr[0], &arr[end]);
+        int_sort_sift_down(arr, 0, end);
+        if (end % INT_SORT_YIELD_STEP == 0)
+            int_sort_yield(yield);
+    }
+}
+
+/**
+ * Hoare partition around the median of the first, middle and last
+ * elements. Equal elements are spread between both sides, so
+ * all-equal input splits in the middle. Return the size of the
+ * left part, every element of which is <= every one of the right.
+ */
+static size_t
+int_sort_partition(int *arr, size_t n)
+{
+    size_t mid = n / 2;
+    if (arr[mid] < arr[0])
+        int_swap(&arr[mid], &arr[0]);
+    if (arr[n - 1] < arr[0])
+        int_swap(&arr[n - 1], &arr[0]);
+    if (arr[n - 1] < arr[mid])
+        int_swap(&arr[n - 1], &arr[mid]);
+    int pivot = arr[mid];
+    size_t i = 0, j = n - 1;
+    for (;;) {
+        while (arr[i] < pivot)
+            ++i;
+        while (arr[j] > pivot)
+            --j;
+        if (i >= j)
+            return j + 1;
+        int_swap(&arr[i], &arr[j]);
+        ++i;
+        --j;
+    }
+}
+
+void
+int_sort_intro(int *arr, size_t n, int_sort_yield_f yield)
+{
+    struct {
+        int *arr;
+        size_t n;
+        int depth;
+    } stack[INT_SORT_STACK_SIZE];
+    int top = 0;
+    int depth = 0;
+    for (size_t m = n; m > 1; m >>= 1)
+        depth += 2;
+    for (;;) {
+        while (n > INT_SORT_INSERTION_MAX) {
+            if (depth == 0) {
+                int_sort_heap(arr, n, yield);
+                n = 0;
+                break;
+            }
+            --depth;
+            size_t left = int_sort_partition(arr, n);
+            int_sort_yield(yield);
+            /* Go on with the smaller part, the bigger one waits. */
+            if (left < n - left) {
+                stack[top].arr = arr + left;
+                stack[top].n = n - left;
+                n = left;
+            } else {
+                stack[top].arr = arr;
+                stack[top].n = left;
+                arr += left;
+                n -= left;
+            }
+            stack[top++].depth = depth;
+        }
+        int_sort_insertion(arr, n);
+        if (top == 0)
+            return;
+        --top;
+        arr = stack[top].arr;
+        n = stack[top].n;
+        depth = stack[top].depth;
+    }
+}
+
+static bool
+int_is_sorted(const int *arr, size_t n)
+{
+    for (size_t i = 1; i < n; i++) {
+        if (arr[i - 1] > arr[i])
+            return false;
+    }
+    return true;
+}
+
+void
+int_sort(int *arr, size_t n, int_sort_yield_f yield)
+{
+    if (int_is_sorted(arr, n))
+        return;
+    if (n >= INT_SORT_RADIX_MIN) {
+        int *tmp = malloc(n * sizeof(int));
+        if (tmp != NULL) {
+            int_sort_radix(arr, n, tmp, yield);
+            free(tmp);
+            return;
+        }
+    }
+    int_sort_intro(arr, n, yield);
+}
@@ -0,0 +1,49 @@
+#ifndef INT_SORT_INCLUDED
+#define INT_SORT_INCLUDED
+
+#include <stddef.h>
+
+/**
+ * Sort kernels for int arrays. None of them recurses, so the depth
+ * of a coroutine stack does not depend on the input. They call a
+ * yield hook every now and then, so a long sort in a coroutine
+ * still lets the others run.
+ */
+
+/** Called between sort steps, for example coro_yield_if_needed. */
+typedef void (*int_sort_yield_f)(void);
+
+enum {
+    /** Ranges up to this size are finished by insertion sort. */
+    INT_SORT_INSERTION_MAX = 16,
+    /** Smaller arrays are not worth the radix sort passes. */
+    INT_SORT_RADIX_MIN = 256,
+};
+
+/**
+ * LSD radix sort by 8-bit digits. O(n), the passes of digits equal
+ * in all the elements are skipped. @a tmp must have room for @a n
+ * integers. @a yield may be NULL.
+ */
+void
+int_sort_radix(int *arr, size_t n, int *tmp, int_sort_yield_f yield);
+
+/**
+ * Introsort: quicksort with a median of 3 pivot and an explicit
+ * stack, heapsort for ranges which have gone too deep, insertion
+ * sort for small ones. O(n log n) in the worst case, sorted and
+ * all-equal input included, with no extra memory. @a yield may be
+ * NULL.
+ */
+void
+int_sort_intro(int *arr, size_t n, int_sort_yield_f yield);
+
+/**
+ * Sort with the best kernel: nothing for an already sorted array,
+ * radix sort when a temporary array can be allocated, introsort
+ * otherwise.
+ */
+void
+int_sort(int *arr, size_t n, int_sort_yield_f yield);
+
+#endif /* INT_SORT_INCLUDED */
@@ -1,76 +1,202 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <setjmp.h>
-#include <signal.h>
-#include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "libcoro.h"
+#include "coro_ctx.h"
+#include "coro_stack.h"
+#include "coro_int.h"
+
+/** Coroutine life cycle. */
+enum coro_state {
+    /** In a run queue, waiting for its turn. */
+    CORO_READY,
+    /** Working right now. */
+    CORO_RUNNING,
+    /** Parked until coro_wakeup(), not in any queue. */
+    CORO_BLOCKED,
+    /** Finished, in the finished queue or already returned. */
+    CORO_FINISHED,
+};
 
-#define handle_error() ({printf("Error %s\n", strerror(errno)); exit(-1);})
+struct coro_sched;
 
 /** Main coroutine structure, its context. */
 struct coro {
     /** A value, returned by func. */
     int ret;
     /** Stack, used by the coroutine. */
-    void *stack;
+    struct coro_stack stack;
     /** An argument for the function func. */
     void *func_arg;
     /** A function to call as a coroutine. */
     coro_f func;
     /** Last remembered coroutine context. */
-    sigjmp_buf ctx;
-    /** True, if the coroutine has finished. */
-    bool is_finished;
+    struct coro_ctx ctx;
+    /** Where the coroutine is in its life cycle. */
+    enum coro_state state;
     long long switch_count;
-    /** Links in the coroutine list, used by scheduler. */
-    struct coro *next, *prev;
+    /** Unique number, for the stats and the trace. */
+    uint64_t id;
+    /** Profile, see struct coro_stats. */
+    uint64_t cpu_time_ns;
+    uint64_t run_time_ns;
+    uint64_t max_slice_ns;
+    size_t stack_max_depth;
+    /** Creation and finish time, 0 if not profiled. */
+    uint64_t created_ns;
+    uint64_t finished_ns;
+    /** Scheduler the coroutine worked on last time. */
+    struct coro_sched *sched;
+    /** Link in a run queue or the finished queue. */
+    struct coro *next;
+};
+
+/** FIFO of coroutines linked through coro->next. */
+struct coro_queue {
+    struct coro *head;
+    struct coro *tail;
+    int count;
 };
 
 /**
- * Scheduler is a main coroutine - it catches and returns dead
- * ones to a user.
- */
-static struct coro coro_sched;
-/**
- * True, if in that moment the scheduler is waiting for a
- * coroutine finish.
+ * Scheduler of one thread. Its loop is a main coroutine - it picks
+ * the next ready coroutine, catches and returns dead ones. Every
+ * switch goes through it, so yield and finish only touch queue
+ * ends. In the M:N mode each worker thread has its own scheduler
+ * and the run queue is shared with thieves under the lock.
  */
-static bool is_sched_waiting = false;
-/** Which coroutine works at this moment. */
-static struct coro *coro_this_ptr = NULL;
-/** List of all the coroutines. */
-static struct coro *coro_list = NULL;
+struct coro_sched {
+    /** Context of the scheduler loop. */
+    struct coro loop;
+    /** Which coroutine works at this moment. */
+    struct coro *current;
+    /** Coroutines ready to run, in order of their turn. */
+    struct coro_queue run_queue;
+    /**
+     * Protects run_queue in the M:N mode and remote_queue in the
+     * single thread one.
+     */
+    pthread_mutex_t lock;
+    /**
+     * Coroutines woken up by not scheduler threads in the single
+     * thread mode, where run_queue has no lock. The owner moves
+     * them to run_queue.
+     */
+    struct coro_queue remote_queue;
+    /** True, if remote_queue is not empty. */
+    atomic_bool has_remote;
+    /**
+     * How many turns are left until the next non-blocking reactor
+     * check. It is done once per run queue round.
+     */
+    int io_poll_countdown;
+    /** Fds and timers the coroutines of this thread wait for. */
+    struct coro_io io;
+    /** Lock to release after the current coroutine has parked. */
+    pthread_mutex_t *park_lock;
+    /** True, if the worker sleeps in the reactor. */
+    bool is_idle;
+    /** State of the victim choice random generator. */
+    unsigned rand_state;
+    /** Thread number for the trace, 0 in the single thread mode. */
+    int id;
+    /**
+     * Set by the time slice thread, cleared when the next turn
+     * starts. See coro_yield_if_needed().
+     */
+    atomic_bool should_yield;
+    pthread_t thread;
+};
+
+/** Scheduler of the thread, which called coro_sched_init(). */
+static struct coro_sched main_sched;
+/** M:N workers. Empty in the single thread mode. */
+static struct coro_sched *workers = NULL;
+static int worker_count = 0;
+/** Round robin position for coroutines created outside workers. */
+static atomic_uint worker_next;
+/** Scheduler of the current thread, NULL for not scheduler ones. */
+static __thread struct coro_sched *sched_this_ptr = NULL;
+
+/** Finished coroutines not yet returned by coro_sched_wait(). */
+static struct coro_queue finished_queue;
+/** How many coroutines are created and not finished. */
+static int alive_count = 0;
+/** Protect the finished queue and alive count in the M:N mode. */
+static pthread_mutex_t finished_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;
+/** How many coroutines are parked. */
+static atomic_int blocked_count;
 /**
- * Buffer, used by the coroutine constructor to escape from the
- * signal handler back into the constructor to rollback
- * sigaltstack etc.
+ * How many wakeups from not scheduler threads are expected. See
+ * coro_remote_ref().
  */
-static sigjmp_buf start_point;
+static atomic_int remote_ref_count;
+
+/** How many coroutines are in all the worker run queues. */
+static atomic_int ready_count;
+/** How many workers sleep in their reactors. */
+static atomic_int idle_count;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool is_stopping;
+
+/** True, if the coroutines are profiled. */
+static atomic_bool profile_is_on;
+/** Source of the coroutine ids. */
+static atomic_ullong coro_next_id;
+
+/** Time slice thread, see coro_sched_set_time_slice(). */
+static pthread_t slice_thread;
+static bool slice_is_on = false;
+static uint64_t slice_ns;
+static pthread_mutex_t slice_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slice_cond;
 
-/** Add a new coroutine to the beginning of the list. */
+/** Add a coroutine to the end of the queue. */
 static void
-coro_list_add(struct coro *c)
+coro_queue_push(struct coro_queue *q, struct coro *c)
 {
-    c->next = coro_list;
-    c->prev = NULL;
-    if (coro_list != NULL)
-        coro_list->prev = c;
-    coro_list = c;
+    c->next = NULL;
+    if (q->tail == NULL)
+        q->head = c;
+    else
+        q->tail->next = c;
+    q->tail = c;
+    ++q->count;
 }
 
-/** Remove a coroutine from the list. */
-static void
-coro_list_delete(struct coro *c)
+/** Take a coroutine from the beginning of the queue. */
+static struct coro *
+coro_queue_pop(struct coro_queue *q)
+{
+    struct coro *c = q->head;
+    if (c == NULL)
+        return NULL;
+    q->head = c->next;
+    if (q->head == NULL)
+        q->tail = NULL;
+    c->next = NULL;
+    --q->count;
+    return c;
+}
+
+/**
+ * Scheduler of the current thread. Not inlined on purpose: a
+ * coroutine can resume on another thread, and the compiler must
+ * not reuse a thread-local address computed before a switch.
+ */
+static __attribute__((noinline)) struct coro_sched *
+coro_sched_this(void)
 {
-    struct coro *prev = c->prev, *next = c->next;
-    if (prev != NULL)
-        prev->next = next;
-    if (next != NULL)
-        next->prev = prev;
-    if (prev == NULL)
-        coro_list = next;
+    __asm__ volatile("" ::: "memory");
+    return sched_this_ptr;
 }
 
 int
@@ -85,173 +211,731 @@ coro_switch_count(const struct coro *c)
     return c->switch_count;
 }
 
+static uint64_t
+coro_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+coro_profile_is_on(void)
+{
+    return atomic_load_explicit(&profile_is_on, memory_order_relaxed);
+}
+
+void
+coro_profile_enable(bool is_enabled)
+{
+    atomic_store(&profile_is_on, is_enabled);
+}
+
+/** How much of the stack is resident, according to mincore(). */
+static size_t
+coro_stack_resident(const struct coro *c)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t size = coro_stack_size(&c->stack);
+    size_t pages = size / page;
+    unsigned char *vec = malloc(pages);
+    if (vec == NULL)
+        return 0;
+    size_t resident = 0;
+    if (mincore(coro_stack_base(&c->stack), size, vec) == 0) {
+        for (size_t i = 0; i < pages; i++)
+            resident += (vec[i] & 1) * page;
+    }
+    free(vec);
+    return resident;
+}
+
+void
+coro_get_stats(const struct coro *c, struct coro_stats *stats)
+{
+    stats->id = c->id;
+    stats->cpu_time_ns = c->cpu_time_ns;
+    stats->run_time_ns = c->run_time_ns;
+    stats->wall_time_ns = 0;
+    if (c->created_ns != 0) {
+        uint64_t end = c->finished_ns != 0 ? c->finished_ns :
+                       coro_clock_ns(CLOCK_MONOTONIC);
+        stats->wall_time_ns = end - c->created_ns;
+    }
+    stats->switch_count = c->switch_count;
+    stats->max_slice_ns = c->max_slice_ns;
+    stats->stack_max_depth = c->stack_max_depth;
+    stats->stack_resident = coro_stack_resident(c);
+}
+
 bool
 coro_is_finished(const struct coro *c)
 {
-    return c->is_finished;
+    return c->state == CORO_FINISHED;
 }
 
 void
 coro_delete(struct coro *c)
 {
-    free(c->stack);
+    coro_stack_free(&c->stack);
     free(c);
 }
 
-/** Switch the current coroutine to an arbitrary one. */
+/** Wake up an idle worker, @a preferred one if it sleeps. */
+static void
+coro_sched_wake_idle(struct coro_sched *preferred)
+{
+    struct coro_sched *w = NULL;
+    pthread_mutex_lock(&idle_lock);
+    if (preferred != NULL && preferred->is_idle) {
+        w = preferred;
+    } else {
+        for (int i = 0; i < worker_count && w == NULL; i++) {
+            if (workers[i].is_idle)
+                w = &workers[i];
+        }
+    }
+    if (w != NULL) {
+        w->is_idle = false;
+        atomic_fetch_sub(&idle_count, 1);
+    }
+    pthread_mutex_unlock(&idle_lock);
+    if (w != NULL)
+        coro_io_notify(&w->io);
+}
+
+/** Put a ready coroutine to the end of the run queue of @a s. */
+static void
+coro_sched_push(struct coro_sched *s, struct coro *c)
+{
+    if (worker_count == 0) {
+        coro_queue_push(&s->run_queue, c);
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    coro_queue_push(&s->run_queue, c);
+    pthread_mutex_unlock(&s->lock);
+    atomic_fetch_add(&ready_count, 1);
+    if (atomic_load(&idle_count) > 0)
+        coro_sched_wake_idle(s);
+}
+
+/**
+ * Queue a coroutine woken up by a not scheduler thread in the
+ * single thread mode. The scheduler is notified under the lock, so
+ * it can not take the coroutine, finish and close the eventfd
+ * before that.
+ */
+static void
+coro_sched_push_remote(struct coro_sched *s, struct coro *c)
+{
+    pthread_mutex_lock(&s->lock);
+    coro_queue_push(&s->remote_queue, c);
+    atomic_store(&s->has_remote, true);
+    if (s->io.event_fd >= 0)
+        coro_io_notify(&s->io);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/** Move the coroutines woken up by other threads to the run queue. */
+static void
+coro_sched_take_remote(struct coro_sched *s)
+{
+    if (! atomic_load(&s->has_remote))
+        return;
+    pthread_mutex_lock(&s->lock);
+    atomic_store(&s->has_remote, false);
+    struct coro *c;
+    while ((c = coro_queue_pop(&s->remote_queue)) != NULL)
+        coro_queue_push(&s->run_queue, c);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/** Take the next coroutine from the own run queue of @a s. */
+static struct coro *
+coro_sched_pop(struct coro_sched *s)
+{
+    if (worker_count == 0)
+        return coro_queue_pop(&s->run_queue);
+    pthread_mutex_lock(&s->lock);
+    struct coro *c = coro_queue_pop(&s->run_queue);
+    pthread_mutex_unlock(&s->lock);
+    if (c != NULL)
+        atomic_fetch_sub(&ready_count, 1);
+    return c;
+}
+
+/**
+ * Take a half of the run queue of some other worker. The first
+ * stolen coroutine is returned, the rest go to the own queue.
+ */
+static struct coro *
+coro_sched_steal(struct coro_sched *s)
+{
+    s->rand_state = s->rand_state * 1103515245 + 12345;
+    int start = (s->rand_state >> 16) % worker_count;
+    for (int i = 0; i < worker_count; i++) {
+        struct coro_sched *victim = &workers[(start + i) % worker_count];
+        if (victim == s)
+            continue;
+        struct coro_queue stolen = {NULL, NULL, 0};
+        pthread_mutex_lock(&victim->lock);
+        int n = (victim->run_queue.count + 1) / 2;
+        while (n-- > 0)
+            coro_queue_push(&stolen, coro_queue_pop(&victim->run_queue));
+        pthread_mutex_unlock(&victim->lock);
+        struct coro *c = coro_queue_pop(&stolen);
+        if (c == NULL)
+            continue;
+        atomic_fetch_sub(&ready_count, 1);
+        if (stolen.count > 0) {
+            pthread_mutex_lock(&s->lock);
+            struct coro *it;
+            while ((it = coro_queue_pop(&stolen)) != NULL)
+                coro_queue_push(&s->run_queue, it);
+            pthread_mutex_unlock(&s->lock);
+        }
+        return c;
+    }
+    return NULL;
+}
+
+/** Hand a finished coroutine over to coro_sched_wait(). */
+static void
+coro_sched_finish(struct coro *c)
+{
+    if (worker_count == 0) {
+        --alive_count;
+        coro_queue_push(&finished_queue, c);
+        return;
+    }
+    pthread_mutex_lock(&finished_lock);
+    --alive_count;
+    coro_queue_push(&finished_queue, c);
+    pthread_cond_signal(&finished_cond);
+    pthread_mutex_unlock(&finished_lock);
+}
+
+/**
+ * Leave the current coroutine for the scheduler. What happens to
+ * the coroutine next is decided by its state.
+ */
 static void
-coro_yield_to(struct coro *to)
+coro_switch_to_sched(struct coro_sched *s, struct coro *from)
 {
-    struct coro *from = coro_this_ptr;
     ++from->switch_count;
-    if (sigsetjmp(from->ctx, 0) == 0)
-        siglongjmp(to->ctx, 1);
-    coro_this_ptr = from;
+    if (coro_profile_is_on()) {
+        char probe;
+        size_t depth = (char *) coro_stack_base(&from->stack) +
+                       coro_stack_size(&from->stack) - &probe;
+        if (depth > from->stack_max_depth)
+            from->stack_max_depth = depth;
+    }
+    coro_ctx_switch(&from->ctx, &s->loop.ctx);
+}
+
+void
+coro_yield_if_needed(void)
+{
+    struct coro_sched *s = coro_sched_this();
+    if (s != NULL &&
+        atomic_load_explicit(&s->should_yield, memory_order_relaxed))
+        coro_yield();
 }
 
 void
 coro_yield(void)
 {
-    struct coro *from = coro_this_ptr;
-    struct coro *to = from->next;
-    if (to == NULL)
-        coro_yield_to(&coro_sched);
+    struct coro_sched *s = coro_sched_this();
+    /* The scheduler itself has nobody to yield to. */
+    if (s == NULL || s->current == &s->loop)
+        return;
+    struct coro *from = s->current;
+    from->state = CORO_READY;
+    coro_switch_to_sched(s, from);
+}
+
+bool
+coro_is_coro(void)
+{
+    struct coro_sched *s = coro_sched_this();
+    return s != NULL && s->current != &s->loop;
+}
+
+void
+coro_park(void)
+{
+    struct coro_sched *s = coro_sched_this();
+    struct coro *from = s->current;
+    from->state = CORO_BLOCKED;
+    atomic_fetch_add(&blocked_count, 1);
+    coro_switch_to_sched(s, from);
+}
+
+void
+coro_park_unlock(pthread_mutex_t *lock)
+{
+    struct coro_sched *s = coro_sched_this();
+    struct coro *from = s->current;
+    from->state = CORO_BLOCKED;
+    atomic_fetch_add(&blocked_count, 1);
+    s->park_lock = lock;
+    coro_switch_to_sched(s, from);
+}
+
+void
+coro_wakeup(struct coro *c)
+{
+    if (c->state != CORO_BLOCKED)
+        return;
+    atomic_fetch_sub(&blocked_count, 1);
+    c->state = CORO_READY;
+    struct coro_sched *s = coro_sched_this();
+    if (s == NULL && worker_count == 0)
+        coro_sched_push_remote(c->sched, c);
     else
-        coro_yield_to(to);
+        coro_sched_push(s != NULL ? s : c->sched, c);
+}
+
+void
+coro_remote_ref(void)
+{
+    atomic_fetch_add(&remote_ref_count, 1);
+    /* The single thread scheduler will sleep in the reactor. */
+    struct coro_sched *s = coro_sched_this();
+    if (worker_count == 0 && s == &main_sched && s->io.event_fd < 0 &&
+        coro_io_enable_notify(&s->io) != 0) {
+        printf("Error %s\n", strerror(errno));
+        exit(-1);
+    }
+}
+
+void
+coro_remote_unref(void)
+{
+    atomic_fetch_sub(&remote_ref_count, 1);
+}
+
+struct coro_io *
+coro_sched_io(void)
+{
+    return &coro_sched_this()->io;
+}
+
+/** Prepare an empty scheduler. */
+static void
+coro_sched_create(struct coro_sched *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->loop.state = CORO_RUNNING;
+    s->loop.sched = s;
+    s->current = &s->loop;
+    pthread_mutex_init(&s->lock, NULL);
+    coro_io_init(&s->io);
+    s->rand_state = (unsigned) (uintptr_t) s;
+}
+
+/** Release what coro_sched_create() and the reactor have taken. */
+static void
+coro_sched_release(struct coro_sched *s)
+{
+    coro_io_destroy(&s->io);
+    pthread_mutex_destroy(&s->lock);
+}
+
+/** Reset the state shared by all the schedulers. */
+static void
+coro_sched_reset_shared(void)
+{
+    memset(&finished_queue, 0, sizeof(finished_queue));
+    alive_count = 0;
+    atomic_init(&blocked_count, 0);
+    atomic_init(&remote_ref_count, 0);
+    atomic_init(&ready_count, 0);
+    atomic_init(&idle_count, 0);
+    atomic_init(&is_stopping, false);
+    atomic_init(&worker_next, 0);
 }
 
 void
 coro_sched_init(void)
 {
-    memset(&coro_sched, 0, sizeof(coro_sched));
-    coro_this_ptr = &coro_sched;
+    coro_sched_reset_shared();
+    coro_sched_create(&main_sched);
+    sched_this_ptr = &main_sched;
+}
+
+/** Run @a c until it yields or finishes and put it where it goes. */
+static void
+coro_sched_run(struct coro_sched *s, struct coro *c)
+{
+    c->state = CORO_RUNNING;
+    c->sched = s;
+    s->current = c;
+    atomic_store_explicit(&s->should_yield, false, memory_order_relaxed);
+    bool is_profiled = coro_profile_is_on();
+    bool is_traced = coro_trace_is_on();
+    uint64_t start = 0, cpu_start = 0;
+    if (is_profiled || is_traced)
+        start = coro_clock_ns(CLOCK_MONOTONIC);
+    if (is_profiled)
+        cpu_start = coro_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    coro_ctx_switch(&s->loop.ctx, &c->ctx);
+    s->current = &s->loop;
+    if (is_profiled || is_traced) {
+        uint64_t end = coro_clock_ns(CLOCK_MONOTONIC);
+        uint64_t slice = end - start;
+        if (is_profiled) {
+            c->cpu_time_ns += coro_clock_ns(CLOCK_THREAD_CPUTIME_ID) -
+                              cpu_start;
+            c->run_time_ns += slice;
+            if (slice > c->max_slice_ns)
+                c->max_slice_ns = slice;
+            if (c->state == CORO_FINISHED && c->created_ns != 0)
+                c->finished_ns = end;
+        }
+        if (is_traced) {
+            enum coro_trace_reason reason =
+                c->state == CORO_READY ? CORO_TRACE_YIELD :
+                c->state == CORO_BLOCKED ? CORO_TRACE_PARK :
+                CORO_TRACE_FINISH;
+            coro_trace_slice(c->id, s->id, start, slice, reason);
+        }
+    }
+    switch (c->state) {
+    case CORO_READY:
+        coro_sched_push(s, c);
+        break;
+    case CORO_FINISHED:
+        coro_sched_finish(c);
+        break;
+    case CORO_BLOCKED:
+        if (s->park_lock != NULL) {
+            pthread_mutex_unlock(s->park_lock);
+            s->park_lock = NULL;
+        }
+        break;
+    default:
+        printf("Critical error - coroutine left in a bad state!\n");
+        exit(-1);
+    }
+}
+
+/**
+ * Check the reactor without blocking once per run queue round, so
+ * CPU-bound coroutines do not starve the waiting ones.
+ */
+static void
+coro_sched_poll_round(struct coro_sched *s)
+{
+    if (coro_io_waiter_count(&s->io) == 0 || --s->io_poll_countdown > 0)
+        return;
+    coro_io_poll(&s->io, false);
+    s->io_poll_countdown = s->run_queue.count + 1;
+}
+
+/** Sleep in the reactor until there is some work for the worker. */
+static void
+coro_worker_idle(struct coro_sched *s)
+{
+    pthread_mutex_lock(&idle_lock);
+    s->is_idle = true;
+    atomic_fetch_add(&idle_count, 1);
+    pthread_mutex_unlock(&idle_lock);
+    /*
+     * Pushers check idle_count after ready_count is increased, so
+     * either they see this worker idle, or it sees their work.
+     */
+    if (atomic_load(&ready_count) == 0 && ! atomic_load(&is_stopping))
+        coro_io_poll(&s->io, true);
+    pthread_mutex_lock(&idle_lock);
+    if (s->is_idle) {
+        s->is_idle = false;
+        atomic_fetch_sub(&idle_count, 1);
+    }
+    pthread_mutex_unlock(&idle_lock);
+}
+
+/** Loop of an M:N worker thread. */
+static void *
+coro_worker_f(void *arg)
+{
+    struct coro_sched *s = (struct coro_sched *) arg;
+    sched_this_ptr = s;
+    while (! atomic_load(&is_stopping)) {
+        coro_sched_poll_round(s);
+        struct coro *c = coro_sched_pop(s);
+        if (c == NULL)
+            c = coro_sched_steal(s);
+        if (c == NULL) {
+            coro_worker_idle(s);
+            continue;
+        }
+        coro_sched_run(s, c);
+    }
+    return NULL;
+}
+
+int
+coro_sched_init_mt(int thread_count)
+{
+    if (thread_count <= 0)
+        return -1;
+    coro_sched_reset_shared();
+    workers = calloc(thread_count, sizeof(*workers));
+    if (workers == NULL)
+        return -1;
+    for (int i = 0; i < thread_count; i++) {
+        coro_sched_create(&workers[i]);
+        workers[i].id = i + 1;
+    }
+    for (int i = 0; i < thread_count; i++) {
+        if (coro_io_enable_notify(&workers[i].io) != 0)
+            goto error;
+    }
+    worker_count = thread_count;
+    /* The caller only creates coroutines and waits for them. */
+    sched_this_ptr = NULL;
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, coro_worker_f,
+                           &workers[i]) != 0) {
+            atomic_store(&is_stopping, true);
+            for (int j = 0; j < i; j++) {
+                coro_io_notify(&workers[j].io);
+                pthread_join(workers[j].thread, NULL);
+            }
+            goto error;
+        }
+    }
+    return 0;
+error:
+    for (int i = 0; i < thread_count; i++)
+        coro_sched_release(&workers[i]);
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+    return -1;
+}
+
+/**
+ * Raise the yield flag of every scheduler once per slice. A turn
+ * started in the middle of a period gets less, but no coroutine
+ * checking the flag runs longer than the slice.
+ */
+static void *
+coro_slice_f(void *arg)
+{
+    (void) arg;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&slice_lock);
+    while (slice_is_on) {
+        uint64_t ns = deadline.tv_nsec + slice_ns;
+        deadline.tv_sec += ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+        if (pthread_cond_timedwait(&slice_cond, &slice_lock,
+                                   &deadline) == 0)
+            continue;
+        if (worker_count == 0) {
+            atomic_store_explicit(&main_sched.should_yield, true,
+                                  memory_order_relaxed);
+        }
+        for (int i = 0; i < worker_count; i++) {
+            atomic_store_explicit(&workers[i].should_yield, true,
+                                  memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&slice_lock);
+    return NULL;
+}
+
+/** Stop the time slice thread, if it works. */
+static void
+coro_slice_stop(void)
+{
+    pthread_mutex_lock(&slice_lock);
+    if (! slice_is_on) {
+        pthread_mutex_unlock(&slice_lock);
+        return;
+    }
+    slice_is_on = false;
+    pthread_cond_signal(&slice_cond);
+    pthread_mutex_unlock(&slice_lock);
+    pthread_join(slice_thread, NULL);
+    pthread_cond_destroy(&slice_cond);
+}
+
+int
+coro_sched_set_time_slice(uint64_t slice_us)
+{
+    coro_slice_stop();
+    if (slice_us == 0)
+        return 0;
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&slice_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    slice_ns = slice_us * 1000;
+    slice_is_on = true;
+    if (pthread_create(&slice_thread, NULL, coro_slice_f, NULL) != 0) {
+        slice_is_on = false;
+        pthread_cond_destroy(&slice_cond);
+        return -1;
+    }
+    return 0;
+}
+
+void
+coro_sched_destroy(void)
+{
+    coro_slice_stop();
+    if (worker_count > 0) {
+        atomic_store(&is_stopping, true);
+        for (int i = 0; i < worker_count; i++)
+            coro_io_notify(&workers[i].io);
+        for (int i = 0; i < worker_count; i++) {
+            pthread_join(workers[i].thread, NULL);
+            coro_sched_release(&workers[i]);
+        }
+        free(workers);
+        workers = NULL;
+        worker_count = 0;
+    } else {
+        coro_sched_release(&main_sched);
+    }
+    coro_stack_cache_drain();
+    sched_this_ptr = NULL;
+}
+
+/** coro_sched_wait() of the M:N mode, the caller is not a worker. */
+static struct coro *
+coro_sched_wait_mt(void)
+{
+    pthread_mutex_lock(&finished_lock);
+    while (finished_queue.count == 0 && alive_count > 0)
+        pthread_cond_wait(&finished_cond, &finished_lock);
+    struct coro *c = coro_queue_pop(&finished_queue);
+    pthread_mutex_unlock(&finished_lock);
+    return c;
 }
 
 struct coro *
 coro_sched_wait(void)
 {
-    while (coro_list != NULL) {
-        for (struct coro *c = coro_list; c != NULL; c = c->next) {
-            if (c->is_finished) {
-                coro_list_delete(c);
-                return c;
+    if (worker_count > 0)
+        return coro_sched_wait_mt();
+    struct coro_sched *s = &main_sched;
+    for (;;) {
+        struct coro *c = coro_queue_pop(&finished_queue);
+        if (c != NULL)
+            return c;
+        if (s->run_queue.count == 0 && ! atomic_load(&s->has_remote) &&
+            atomic_load(&blocked_count) > 0 &&
+            (coro_io_waiter_count(&s->io) > 0 ||
+             atomic_load(&remote_ref_count) > 0))
+            coro_io_poll(&s->io, true);
+        else
+            coro_sched_poll_round(s);
+        coro_sched_take_remote(s);
+        c = coro_sched_pop(s);
+        if (c == NULL) {
+            if (atomic_load(&blocked_count) == 0)
+                return NULL;
+            /*
+             * A waker drops its reference after the wakeup is
+             * queued, so has_remote is checked after the count.
+             */
+            if (coro_io_waiter_count(&s->io) == 0 &&
+                atomic_load(&remote_ref_count) == 0 &&
+                ! atomic_load(&s->has_remote)) {
+                printf("Critical error - all coroutines are blocked!\n");
+                exit(-1);
             }
+            continue;
         }
-        is_sched_waiting = true;
-        coro_yield_to(coro_list);
-        is_sched_waiting = false;
+        coro_sched_run(s, c);
     }
-    return NULL;
 }
 
 struct coro *
 coro_this(void)
 {
-    return coro_this_ptr;
+    struct coro_sched *s = coro_sched_this();
+    return s != NULL ? s->current : NULL;
 }
 
 /**
- * The core part of the coroutines creation - this signal handler
- * is run on a separate stack using sigaltstack. On an invokation
- * it remembers its current context and jumps back to the
- * coroutine constructor. Later the coroutine continues from here.
+ * Entry point of every coroutine, run on its own stack by the
+ * first switch into it.
  */
 static void
-coro_body(int signum)
+coro_body(void *arg)
 {
-    struct coro *c = coro_this_ptr;
-    coro_this_ptr = NULL;
-    /*
-     * On an invokation jump back to the constructor right
-     * after remembering the context.
-     */
-    if (sigsetjmp(c->ctx, 0) == 0)
-        siglongjmp(start_point, 1);
-    /*
-     * If the execution is here, then the coroutine should
-     * finaly start work.
-     */
-    coro_this_ptr = c;
+    struct coro *c = (struct coro *) arg;
     c->ret = c->func(c->func_arg);
-    c->is_finished = true;
+    c->state = CORO_FINISHED;
     /* Can not return - 'ret' address is invalid already! */
-    if (! is_sched_waiting) {
-        printf("Critical error - no place to return!\n");
-        exit(-1);
-    }
-    siglongjmp(coro_sched.ctx, 1);
+    coro_ctx_switch(&c->ctx, &coro_sched_this()->loop.ctx);
+}
+
+void
+coro_attr_init(struct coro_attr *attr)
+{
+    attr->stack_size = CORO_STACK_DEFAULT_SIZE;
 }
 
 struct coro *
-coro_new(coro_f func, void *func_arg)
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr)
 {
+    struct coro_attr default_attr;
+    if (attr == NULL) {
+        coro_attr_init(&default_attr);
+        attr = &default_attr;
+    }
     struct coro *c = (struct coro *) malloc(sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    if (coro_stack_alloc(&c->stack, attr->stack_size) != 0) {
+        free(c);
+        return NULL;
+    }
     c->ret = 0;
-    int stack_size = 1024 * 1024;
-    if (stack_size < SIGSTKSZ)
-        stack_size = SIGSTKSZ;
-    c->stack = malloc(stack_size);
     c->func = func;
     c->func_arg = func_arg;
-    c->is_finished = false;
+    c->state = CORO_READY;
     c->switch_count = 0;
+    c->id = atomic_fetch_add(&coro_next_id, 1) + 1;
+    c->cpu_time_ns = c->run_time_ns = c->max_slice_ns = 0;
+    c->stack_max_depth = 0;
+    c->created_ns = c->finished_ns = 0;
+    if (coro_profile_is_on())
+        c->created_ns = coro_clock_ns(CLOCK_MONOTONIC);
+    c->next = NULL;
+    coro_ctx_make(&c->ctx, coro_stack_base(&c->stack),
+                  coro_stack_size(&c->stack), coro_body, c);
+
     /*
-     * SIGUSR2 is used. First of all, block new signals to be
-     * able to set a new handler.
-     */
-    sigset_t news, olds, suss;
-    sigemptyset(&news);
-    sigaddset(&news, SIGUSR2);
-    if (sigprocmask(SIG_BLOCK, &news, &olds) != 0)
-        handle_error();
-    /*
-     * New handler should jump onto a new stack and remember
-     * that position. Afterwards the stack is disabled and
-     * becomes dedicated to that single coroutine.
+     * Now scheduler can work with that coroutine. Outside of the
+     * workers the M:N mode spreads new coroutines round robin.
      */
-    struct sigaction newsa, oldsa;
-    newsa.sa_handler = coro_body;
-    newsa.sa_flags = SA_ONSTACK;
-    sigemptyset(&newsa.sa_mask);
-    if (sigaction(SIGUSR2, &newsa, &oldsa) != 0)
-        handle_error();
-    /* Create that new stack. */
-    stack_t oldst, newst;
-    newst.ss_sp = c->stack;
-    newst.ss_size = stack_size;
-    newst.ss_flags = 0;
-    if (sigaltstack(&newst, &oldst) != 0)
-        handle_error();
-    /* Jump onto the stack and remember its position. */
-    struct coro *old_this = coro_this_ptr;
-    coro_this_ptr = c;
-    sigemptyset(&suss);
-    if (sigsetjmp(start_point, 1) == 0) {
-        raise(SIGUSR2);
-        while (coro_this_ptr != NULL)
-            sigsuspend(&suss);
+    struct coro_sched *s = coro_sched_this();
+    if (s == NULL && worker_count > 0)
+        s = &workers[atomic_fetch_add(&worker_next, 1) % worker_count];
+    c->sched = s;
+    if (worker_count > 0) {
+        pthread_mutex_lock(&finished_lock);
+        ++alive_count;
+        pthread_mutex_unlock(&finished_lock);
+    } else {
+        ++alive_count;
     }
-    coro_this_ptr = old_this;
-    /*
-     * Return the old stack, unblock SIGUSR2. In other words,
-     * rollback all global changes. The newly created stack
-     * now is remembered only by the new coroutine, and can be
-     * used by it only.
-     */
-    if (sigaltstack(NULL, &newst) != 0)
-        handle_error();
-    newst.ss_flags = SS_DISABLE;
-    if (sigaltstack(&newst, NULL) != 0)
-        handle_error();
-    if ((oldst.ss_flags & SS_DISABLE) == 0 &&
-        sigaltstack(&oldst, NULL) != 0)
-        handle_error();
-    if (sigaction(SIGUSR2, &oldsa, NULL) != 0)
-        handle_error();
-    if (sigprocmask(SIG_SETMASK, &olds, NULL) != 0)
-        handle_error();
-
-    /* Now scheduler can work with that coroutine. */
-    coro_list_add(c);
+    coro_sched_push(s, c);
     return c;
-}
\ No newline at end of file
+}
+
+struct coro *
+coro_new(coro_f func, void *func_arg)
+{
+    return coro_new_ex(func, func_arg, NULL);
+}
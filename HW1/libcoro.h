@@ -2,6 +2,10 @@
 #define LIBCORO_INCLUDED
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 struct coro;
 typedef int (*coro_f)(void *);
@@ -10,24 +14,80 @@ typedef int (*coro_f)(void *);
 void
 coro_sched_init(void);
 
+/**
+ * M:N mode. Start @a thread_count worker threads, each running its
+ * own scheduler. Coroutines are spread between the workers, and
+ * idle workers steal ready coroutines from busy ones, so a
+ * coroutine can resume on another thread after a yield. The
+ * caller does not run coroutines, it only creates them and waits
+ * in coro_sched_wait().
+ * @retval 0 Success.
+ * @retval -1 Error.
+ */
+int
+coro_sched_init_mt(int thread_count);
+
 /**
  * Block until any coroutine has finished. It is returned. NULl,
- * if no coroutines.
+ * if no coroutines. While waiting, the scheduler also serves the
+ * reactor of coro_read(), coro_sleep_us() and friends.
  */
 struct coro *
 coro_sched_wait(void);
 
-/** Currently working coroutine. */
+/**
+ * Set the time slice of coroutines: how long one may run before
+ * coro_yield_if_needed() yields. A helper thread raises a flag of
+ * every scheduler once per slice, so the check costs a load
+ * instead of a clock read. 0 turns the slicing off. Call it after
+ * the scheduler is initialized.
+ * @retval 0 Success.
+ * @retval -1 Error.
+ */
+int
+coro_sched_set_time_slice(uint64_t slice_us);
+
+/**
+ * Free the scheduler resources: reactor descriptors and cached
+ * stacks. All coroutines must be deleted already.
+ */
+void
+coro_sched_destroy(void);
+
+/**
+ * Currently working coroutine of this thread. NULL in a thread
+ * which is not a scheduler.
+ */
 struct coro *
 coro_this(void);
 
+/** Coroutine creation attributes. */
+struct coro_attr {
+    /**
+     * Usable stack size in bytes, rounded up to whole pages.
+     * Memory is committed only for the pages actually touched.
+     */
+    size_t stack_size;
+};
+
+/** Fill @a attr with the default values. */
+void
+coro_attr_init(struct coro_attr *attr);
+
 /**
  * Create a new coroutine. It is not started, just added to the
- * scheduler.
+ * scheduler. NULL, if no memory for it.
  */
 struct coro *
 coro_new(coro_f func, void *func_arg);
 
+/**
+ * Same as coro_new(), but with explicit attributes. NULL @a attr
+ * means the default ones.
+ */
+struct coro *
+coro_new_ex(coro_f func, void *func_arg, const struct coro_attr *attr);
+
 /** Return status of the coroutine. */
 int
 coro_status(const struct coro *c);
@@ -35,11 +95,71 @@ coro_status(const struct coro *c);
 long long
 coro_switch_count(const struct coro *c);
 
+/** Profile of a coroutine, collected while profiling is enabled. */
+struct coro_stats {
+    /** Unique number of the coroutine, also used in the trace. */
+    uint64_t id;
+    /** CPU time of the threads while they ran the coroutine. */
+    uint64_t cpu_time_ns;
+    /** Wall clock time the coroutine was running. */
+    uint64_t run_time_ns;
+    /** Time from creation till finish, or till now. */
+    uint64_t wall_time_ns;
+    long long switch_count;
+    /** Longest time the coroutine ran without a switch. */
+    uint64_t max_slice_ns;
+    /** Deepest stack usage seen at switches. */
+    size_t stack_max_depth;
+    /**
+     * Resident stack memory, an upper bound of its high-water
+     * mark. A reused stack can keep pages of its previous owner.
+     */
+    size_t stack_resident;
+};
+
+/**
+ * Turn per-coroutine profiling on or off. It costs a couple of
+ * clock reads per switch, so it is off by default.
+ */
+void
+coro_profile_enable(bool is_enabled);
+
+/** Fill @a stats with the profile of the coroutine. */
+void
+coro_get_stats(const struct coro *c, struct coro_stats *stats);
+
+/**
+ * Start recording the scheduler trace into a ring of @a capacity
+ * events, one per coroutine turn. The oldest events are overwritten
+ * when the ring is full.
+ * @retval 0 Success.
+ * @retval -1 Error, or the trace is already on.
+ */
+int
+coro_trace_start(size_t capacity);
+
+/** Stop recording. The recorded events are kept for a dump. */
+void
+coro_trace_stop(void);
+
+/**
+ * Write the recorded events to @a path in Chrome trace JSON
+ * format, readable by chrome://tracing and Perfetto. Call it after
+ * coro_trace_stop().
+ * @retval 0 Success.
+ * @retval -1 Error.
+ */
+int
+coro_trace_dump(const char *path);
+
 /** Check if the coroutine has finished. */
 bool
 coro_is_finished(const struct coro *c);
 
-/** Free coroutine stack and it itself. */
+/**
+ * Free the coroutine. Its stack goes back to the stack cache to be
+ * reused by next coroutines.
+ */
 void
 coro_delete(struct coro *c);
 
@@ -47,4 +167,49 @@ coro_delete(struct coro *c);
 void
 coro_yield(void);
 
+/**
+ * Yield, if the time slice of the current coroutine is over. Cheap
+ * enough to be called from hot loops. Does nothing without
+ * coro_sched_set_time_slice().
+ */
+void
+coro_yield_if_needed(void);
+
+/**
+ * I/O API. These calls park the current coroutine until @a fd is
+ * ready and let the scheduler run others meanwhile. The fd must be
+ * in O_NONBLOCK mode, otherwise the call blocks the whole scheduler
+ * like the plain syscall does. Regular files can not be polled, so
+ * for them the calls are the same as the syscalls. Only one
+ * coroutine may wait for one fd at a time. Called not from a
+ * coroutine, they block the thread.
+ */
+
+/** read(2) for coroutines. */
+ssize_t
+coro_read(int fd, void *buf, size_t count);
+
+/**
+ * write(2) for coroutines. Unlike the syscall, writes all the
+ * @a count bytes unless an error happens. Returns how many bytes
+ * were written, or -1 if none.
+ */
+ssize_t
+coro_write(int fd, const void *buf, size_t count);
+
+/**
+ * accept(2) for coroutines. The new socket is created with
+ * O_NONBLOCK and O_CLOEXEC.
+ */
+int
+coro_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/**
+ * Sleep for @a usec microseconds, letting other coroutines work.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+coro_sleep_us(uint64_t usec);
+
 #endif /* LIBCORO_INCLUDED */
\ No newline at end of file
@@ -1,25 +1,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "libcoro.h"
-#include "limits.h"
+#include "ext_sort.h"
+#include "merge.h"
+#include "int_io.h"
+#include "int_sort.h"
+#include "coro_pool.h"
 #include <time.h>
 #include "string.h"
+#include <stdatomic.h>
+#include <errno.h>
 
 // arguments for coroutine
 typedef struct arguments {
     char **filenames;
-    int *current_file_i;
+    atomic_int *current_file_i;
     int files_amount;
     int **arrays;
     int *sizes;
+    struct int_bin_map *maps; // mapped binary inputs, map is NULL for text ones
     int name;
+    struct ext_sort *es; // not NULL in the external sort mode
+    struct thread_pool *pool; // not NULL when big arrays are sorted by pool threads
+    int pool_threads;
 }arguments;
 
-static u_int64_t yield_time; // timestamp of last yield
-static int coro_target_latency; // target latency / number of coroutines
-static u_int64_t *coro_live_time;
-static u_int64_t *coro_start_time;
+// arrays from this size on are worth cutting into parts for pool threads
+enum { PARALLEL_SORT_MIN = 1 << 20 };
+
 
 // get current timestamp in microseconds
 u_int64_t GetTimeStamp() {
@@ -28,125 +39,181 @@ u_int64_t GetTimeStamp() {
     return ts.tv_sec*1000000+ts.tv_nsec/1000;
 }
 
-// make yield if target latency end
-void my_yield(int coro_name) {
-    u_int64_t current_time = GetTimeStamp();
-    if (current_time >= yield_time + coro_target_latency) {
-//        printf("Yield at timestamp: %lu\n", current_time);
-        yield_time = current_time;
-        coro_live_time[coro_name] += current_time - coro_start_time[coro_name];
-        coro_yield();
-        coro_start_time[coro_name] = GetTimeStamp();
+// read data from file
+// regular files are mapped, a slow pipe or FIFO input is read through coro_read and parks only this coroutine
+void read_file(int **arrays, int array_i, char *filename, int *size) {
+    int *data;
+    size_t count;
+    off_t error_offset;
+    if (int_file_read(filename, &data, &count, &error_offset) != 0) {
+        if (errno == EINVAL) {
+            printf("%s: not a number at offset %lld\n", filename, (long long) error_offset);
+        } else {
+            printf("Can not read %s: %s\n", filename, strerror(errno));
+        }
+    }
+    *size = (int) count;
+    if (data != NULL) {
+        free(arrays[array_i]);
+        arrays[array_i] = data;
     }
 }
 
-// part of quick sort
-int partition(int *arr, int low, int high) {
-    int pivot = arr[high];
-    int i = low - 1;
-    for (int j = low; j <= high - 1; j++) {
-        if (arr[j] < pivot) {
-            i++;
-            int temp = arr[j];
-            arr[j] = arr[i];
-            arr[i] = temp;
-        }
-    }
-    i++;
-    int temp = arr[high];
-    arr[high] = arr[i];
-    arr[i] = temp;
-    return i;
+// one part of a big array, sorted by a pool thread
+typedef struct sort_part {
+    int *arr;
+    size_t count;
+}sort_part;
+
+void *sort_part_task(void *arg) {
+    sort_part *part = arg;
+    int_sort(part->arr, part->count, NULL);
+    return NULL;
 }
 
-// quick sort implementation
-void sort(int *arr, int low, int high, int coro_name) {
-    if (low < high) {
-        int pi = partition(arr, low, high);
-        my_yield(coro_name);
-        sort(arr, low, pi - 1, coro_name);
-        sort(arr, pi + 1, high, coro_name);
-    }
+// merge of the sorted parts back into the array, also done by a pool thread
+typedef struct merge_parts {
+    sort_part *parts;
+    int parts_amount;
+    int *arr;
+    int *tmp;
+    size_t count;
+}merge_parts;
+
+int buffer_write(void *ctx, const int *arr, size_t count) {
+    int **pos = ctx;
+    memcpy(*pos, arr, count * sizeof(int));
+    *pos += count;
+    return 0;
 }
 
-// read data from file
-void read_file(int **arrays, int array_i, char *filename, int *size) {
-    FILE *file;
-    file = fopen(filename, "r");
-    if (file == NULL) {
-        return;
+void *merge_parts_task(void *arg) {
+    merge_parts *m = arg;
+    struct merge_source sources[m->parts_amount];
+    struct merge_source *srcs[m->parts_amount];
+    for (int i = 0; i < m->parts_amount; i++) {
+        sources[i].pos = m->parts[i].arr;
+        sources[i].end = m->parts[i].arr + m->parts[i].count;
+        sources[i].next = NULL;
+        srcs[i] = &sources[i];
     }
+    int batch[4096];
+    int *pos = m->tmp;
+    merge_k(srcs, m->parts_amount, batch, 4096, buffer_write, &pos);
+    memcpy(m->arr, m->tmp, m->count * sizeof(int));
+    return NULL;
+}
 
-    int i = 0;
-    while(!feof(file)) {
-        if (i > 0 && i % 10 == 0) {
-            arrays[array_i] = realloc(arrays[array_i], (i + 10) * sizeof(int));
-        }
-        fscanf(file, "%d", &arrays[array_i][i++]);
+// sort a big array by pool threads: its parts are sorted in parallel, then merged by one more task
+// the coroutine parks until the tasks are done, so the others go on with their files meanwhile
+int sort_parallel(struct thread_pool *pool, int parts_amount, int *arr, size_t count) {
+    struct coro_pool_batch *batch = coro_pool_batch_new(pool);
+    int *tmp = malloc(count * sizeof(int));
+    if (batch == NULL || tmp == NULL) {
+        if (batch != NULL) coro_pool_batch_delete(batch);
+        free(tmp);
+        return -1;
+    }
+    sort_part parts[parts_amount];
+    size_t step = count / parts_amount;
+    for (int i = 0; i < parts_amount; i++) {
+        parts[i].arr = arr + i * step;
+        parts[i].count = i == parts_amount - 1 ? count - i * step : step;
+        // the pool is full - sort the part right here
+        if (coro_pool_batch_push(batch, sort_part_task, &parts[i]) != 0) sort_part_task(&parts[i]);
     }
-    *size = i;
-    fclose(file);
+    coro_pool_batch_wait(batch);
+    merge_parts m = {parts, parts_amount, arr, tmp, count};
+    if (coro_pool_batch_push(batch, merge_parts_task, &m) != 0) merge_parts_task(&m);
+    coro_pool_batch_wait(batch);
+    coro_pool_batch_delete(batch);
+    free(tmp);
+    return 0;
 }
 
 // coroutine function
 // char **filenames, int *current_file_i, int files_amount, int **arrays, int *sizes
 int worker(void *context) {
     arguments *args = context;
-    coro_start_time[args->name] = GetTimeStamp();
     while (1) {
-        int current_i = (*args->current_file_i)++;
+        int current_i = atomic_fetch_add(args->current_file_i, 1);
         if (current_i >= args->files_amount) break;
-        read_file(args->arrays, current_i, args->filenames[current_i], &args->sizes[current_i]);
+        if (args->es != NULL) {
+            off_t error_offset;
+            if (ext_sort_add_file(args->es, args->filenames[current_i], &error_offset) != 0) {
+                if (errno == EINVAL) {
+                    printf("%s: not a number at offset %lld\n", args->filenames[current_i], (long long) error_offset);
+                } else {
+                    printf("Can not sort %s: %s\n", args->filenames[current_i], strerror(errno));
+                }
+            } else {
+                printf("%s file sorted into runs by coroutine %d\n", args->filenames[current_i], args->name);
+            }
+            continue;
+        }
+        // binary files are mapped and sorted right in the mapping, a sorted one needs no work at all
+        struct int_bin_map *map = &args->maps[current_i];
+        if (int_file_is_bin(args->filenames[current_i])) {
+            if (int_bin_map(args->filenames[current_i], map) != 0) {
+                printf("Can not map %s: %s\n", args->filenames[current_i], strerror(errno));
+                continue;
+            }
+            free(args->arrays[current_i]);
+            args->arrays[current_i] = map->data;
+            args->sizes[current_i] = (int) map->count;
+            if (map->is_sorted) {
+                printf("%s file is already sorted\n", args->filenames[current_i]);
+                continue;
+            }
+        } else {
+            read_file(args->arrays, current_i, args->filenames[current_i], &args->sizes[current_i]);
+        }
         printf("%s file read by coroutine %d\n", args->filenames[current_i], args->name);
-        sort(args->arrays[current_i], 0, args->sizes[current_i] - 1, args->name);
+        if (args->pool != NULL && args->sizes[current_i] >= PARALLEL_SORT_MIN &&
+            sort_parallel(args->pool, args->pool_threads, args->arrays[current_i], args->sizes[current_i]) == 0) {
+            printf("%s file sorted by coroutine %d with %d pool threads\n", args->filenames[current_i], args->name,
+                   args->pool_threads);
+            continue;
+        }
+        // yields when the time slice set by -l is over
+        int_sort(args->arrays[current_i], args->sizes[current_i], coro_yield_if_needed);
         printf("%s file sorted by coroutine %d\n", args->filenames[current_i], args->name);
     }
-    coro_live_time[args->name] += GetTimeStamp() - coro_start_time[args->name];
-    printf("Coroutine %d finished. Its switch count: %lld , work time: %llu us\n", args->name,
-          coro_switch_count(coro_this()), coro_live_time[args->name]);
     return 0;
 }
 
-// write output data
-void write_file(int *arr, int n) {
-    FILE *file;
-    file = fopen("output.txt", "w");
-    for (int i = 0; i < n; i++) {
-        fprintf(file, "%d ", arr[i]);
-    }
-    fclose(file);
+// sort one run of the external sort, in place - radix sort would take memory beyond the budget
+void sort_run(int *arr, size_t count) {
+    int_sort_intro(arr, count, coro_yield_if_needed);
 }
 
-// merge sorted arrays
-void merge(int *arrays[], int *sizes, int n) {
-    int total_size = 0;
-    int iterators[n];
+// merge sorted arrays with a loser tree, the result is formatted into a big buffer and written by write(2)
+void merge(int *arrays[], int *sizes, int n, const char *output, enum int_format format) {
+    size_t total_size = 0;
+    struct merge_source sources[n];
+    struct merge_source *srcs[n];
     for (int i = 0; i < n; i++) {
-        iterators[i] = 0;
+        sources[i].pos = arrays[i];
+        sources[i].end = arrays[i] + sizes[i];
+        sources[i].next = NULL;
+        srcs[i] = &sources[i];
         total_size += sizes[i];
     }
-    int result[total_size];
-    int result_i = 0;
-
-    while (1) {
-        int min = INT_MAX;
-        int min_i = -1;
-
-        for (int i = 0; i < n; i++) {
-            if (iterators[i] == sizes[i]) continue;
-            if (arrays[i][iterators[i]] < min) {
-                min = arrays[i][iterators[i]];
-                min_i = i;
-            }
-        }
-
-        if (min_i == -1) break;
-
-        while (min == arrays[min_i][iterators[min_i]] && iterators[min_i] < sizes[min_i]) {
-            result[result_i++] = arrays[min_i][iterators[min_i]++];
-        }
+    int batch[4096];
+    struct int_writer writer;
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || (format == INT_FORMAT_BIN && int_bin_write_header(fd, total_size, true) != 0) ||
+        int_writer_create(&writer, fd, format, INT_WRITER_BUF_SIZE) != 0) {
+        printf("Can not write %s\n", output);
+        if (fd >= 0) close(fd);
+        return;
     }
-    write_file(result, result_i);
+    if (merge_k(srcs, n, batch, 4096, int_writer_write, &writer) != 0 ||
+        int_writer_flush(&writer) != 0) {
+        printf("Can not write %s\n", output);
+    }
+    int_writer_destroy(&writer);
+    close(fd);
 }
 
 
@@ -155,6 +222,13 @@ int main(int argc, char *argv[]) {
     // take data from system arguments
     int cor_nums = 3;
     int target_latency = 50;
+    int threads = 0;
+    char *trace_path = NULL;
+    long memory_mb = 0;
+    int pool_threads = 0;
+    // -b writes the result in the binary format
+    const char *output = "output.txt";
+    enum int_format output_format = INT_FORMAT_TEXT;
     char **filenames = calloc(argc - 1, sizeof(int*));
     int files_amount = 0;
     for (int i = 1; i < argc; i++) {
@@ -162,57 +236,138 @@ int main(int argc, char *argv[]) {
             cor_nums = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-l") == 0) {
             target_latency = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-trace") == 0) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0) {
+            pool_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0) {
+            memory_mb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            output = "output.bin";
+            output_format = INT_FORMAT_BIN;
         } else {
             filenames[files_amount++] = argv[i];
         }
     }
 
     // initialize input and output data for coroutines
-    coro_target_latency = target_latency / cor_nums;
-    int current_file_i = 0;
+    atomic_int current_file_i = 0;
     int sizes[files_amount];
     int *arrays[files_amount];
+    struct int_bin_map maps[files_amount];
     for (int i = 0; i < files_amount; i++) {
         arrays[i] = (int*)calloc(10, sizeof(int));
+        sizes[i] = 0;
+        maps[i].map = NULL;
     }
 
-    coro_sched_init();
+    // with -t coroutines run on several worker threads
+    if (threads > 0) {
+        if (coro_sched_init_mt(threads) != 0) {
+            printf("Can not start %d worker threads\n", threads);
+            return 1;
+        }
+    } else {
+        coro_sched_init();
+    }
+
+    // target latency is shared by all coroutines, a slice of 0 would turn the yields off
+    int time_slice = target_latency / cor_nums;
+    if (time_slice < 1)
+        time_slice = 1;
+    if (coro_sched_set_time_slice(time_slice) != 0) {
+        printf("Can not start the time slice thread\n");
+        return 1;
+    }
+
+    // the library measures work time of each coroutine, -trace also records every switch
+    coro_profile_enable(true);
+    if (trace_path != NULL && coro_trace_start(1 << 20) != 0) {
+        printf("Can not start the trace\n");
+        return 1;
+    }
+
+    // with -m the files are sorted externally within the memory budget
+    struct ext_sort *es = NULL;
+    if (memory_mb > 0) {
+        es = ext_sort_new((size_t) memory_mb << 20, cor_nums, sort_run);
+        if (es == NULL) {
+            printf("Memory budget %ld MB is too small for %d coroutines\n", memory_mb, cor_nums);
+            return 1;
+        }
+    }
+
+    // with -p big files are sorted in parts by a thread pool
+    struct thread_pool *pool = NULL;
+    if (pool_threads > 0 && thread_pool_new(pool_threads, &pool) != 0) {
+        printf("Can not create a pool of %d threads\n", pool_threads);
+        return 1;
+    }
 
     // collect arguments for coroutines
     arguments worker_args[cor_nums];
+    struct coro *coros[cor_nums];
 
-    // set time and start coroutines
-    yield_time = GetTimeStamp();
-    coro_live_time = calloc(cor_nums, sizeof(u_int64_t));
-    coro_start_time = calloc(cor_nums, sizeof(u_int64_t));
+    // start coroutines
     for (int i = 0; i < cor_nums; ++i) {
         worker_args[i].filenames = filenames;
         worker_args[i].current_file_i = &current_file_i;
         worker_args[i].files_amount = files_amount;
         worker_args[i].arrays = arrays;
         worker_args[i].sizes = sizes;
+        worker_args[i].maps = maps;
         worker_args[i].name = i;
-        coro_live_time[i] = 0;
-        coro_start_time[i] = 0;
-        coro_new(worker, &worker_args[i]);
+        worker_args[i].es = es;
+        worker_args[i].pool = pool;
+        worker_args[i].pool_threads = pool_threads;
+        coros[i] = coro_new(worker, &worker_args[i]);
     }
 
     // wait the end of coroutines and delete their
     struct coro *c;
     while ((c = coro_sched_wait()) != NULL) {
+        int name = 0;
+        while (coros[name] != c) name++;
+        struct coro_stats stats;
+        coro_get_stats(c, &stats);
+        printf("Coroutine %d finished. Its switch count: %lld , work time: %llu us, "
+               "cpu time: %llu us, max slice: %llu us, stack: %zu bytes\n", name,
+               stats.switch_count, (unsigned long long) stats.run_time_ns / 1000,
+               (unsigned long long) stats.cpu_time_ns / 1000,
+               (unsigned long long) stats.max_slice_ns / 1000, stats.stack_max_depth);
         coro_delete(c);
     }
+    if (trace_path != NULL) {
+        coro_trace_stop();
+        if (coro_trace_dump(trace_path) != 0) {
+            printf("Can not write the trace to %s\n", trace_path);
+        }
+    }
 
     // merge data
-    merge(arrays, sizes, files_amount);
-    printf("All files merged in output.txt\n");
+    if (es != NULL) {
+        printf("%lld numbers in %d runs\n", ext_sort_count(es), ext_sort_run_count(es));
+        if (ext_sort_finish(es, output, output_format) != 0) {
+            printf("Can not merge runs: %s\n", strerror(errno));
+        }
+        ext_sort_delete(es);
+    } else {
+        merge(arrays, sizes, files_amount, output, output_format);
+    }
+    printf("All files merged in %s\n", output);
 
-    // free space of calloc
+    // free space of calloc and mappings
     for (int i = 0; i < files_amount; i++) {
-        free(arrays[i]);
+        if (maps[i].map != NULL) {
+            int_bin_unmap(&maps[i]);
+        } else {
+            free(arrays[i]);
+        }
     }
-    free(coro_start_time);
-    free(coro_live_time);
+    if (pool != NULL) thread_pool_delete(pool);
+    coro_sched_destroy();
 
     printf("Total work time: %llu us", GetTimeStamp() - start_time);
     return 0;
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include "merge.h"
+
+/**
+ * Loser tree. Node 0 keeps the index of the current winner, nodes
+ * 1 .. k - 1 keep the losers of the matches played in them. Leaf i
+ * hangs under node (i + k) / 2. After the winner has advanced only
+ * its path to the root is replayed.
+ */
+struct loser_tree {
+    struct merge_source **srcs;
+    int k;
+    int *nodes;
+};
+
+/**
+ * True, if source @a a goes before source @a b. An exhausted
+ * source loses to everybody, index k is a fake source used to
+ * build the tree and wins over everybody.
+ */
+static inline bool
+loser_tree_less(const struct loser_tree *t, int a, int b)
+{
+    if (a == t->k)
+        return true;
+    if (b == t->k)
+        return false;
+    const struct merge_source *sa = t->srcs[a], *sb = t->srcs[b];
+    if (sb->pos == sb->end)
+        return sa->pos != sa->end || a < b;
+    if (sa->pos == sa->end)
+        return false;
+    return *sa->pos < *sb->pos || (*sa->pos == *sb->pos && a < b);
+}
+
+/** Play the matches on the path from leaf @a i to the root. */
+static inline void
+loser_tree_replay(struct loser_tree *t, int i)
+{
+    int winner = i;
+    for (int p = (i + t->k) / 2; p > 0; p /= 2) {
+        if (loser_tree_less(t, t->nodes[p], winner)) {
+            int loser = winner;
+            winner = t->nodes[p];
+            t->nodes[p] = loser;
+        }
+    }
+    t->nodes[0] = winner;
+}
+
+int
+merge_k(struct merge_source **srcs, int count, int *batch,
+        size_t batch_size, merge_sink_f sink, void *ctx)
+{
+    if (count == 0)
+        return 0;
+    struct loser_tree t;
+    t.srcs = srcs;
+    t.k = count;
+    t.nodes = calloc(count, sizeof(*t.nodes));
+    if (t.nodes == NULL)
+        return -1;
+    /*
+     * Fill the tree with fake winners. Every real leaf pushes one
+     * of them out, so after all the leaves are played none is left.
+     */
+    for (int i = 0; i < count; i++)
+        t.nodes[i] = count;
+    for (int i = count - 1; i >= 0; i--)
+        loser_tree_replay(&t, i);
+    size_t len = 0;
+    int rc = 0;
+    for (;;) {
+        int w = t.nodes[0];
+        struct merge_source *src = srcs[w];
+        /* The winner is over - so are all the others. */
+        if (src->pos == src->end)
+            break;
+        batch[len++] = *src->pos++;
+        if (len == batch_size) {
+            if ((rc = sink(ctx, batch, len)) != 0)
+                break;
+            len = 0;
+        }
+        if (src->pos == src->end && src->next != NULL &&
+            (rc = src->next(src)) != 0)
+            break;
+        loser_tree_replay(&t, w);
+    }
+    if (rc == 0 && len > 0)
+        rc = sink(ctx, batch, len);
+    free(t.nodes);
+    return rc;
+}
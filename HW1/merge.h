@@ -0,0 +1,50 @@
+#ifndef MERGE_INCLUDED
+#define MERGE_INCLUDED
+
+#include <stddef.h>
+
+/**
+ * K-way merge of sorted integer sequences on a loser tree. Each
+ * output element costs log2(k) comparisons instead of a scan of
+ * all k heads. Sources are read and the result is given away in
+ * batches, so neither side has to be in memory whole.
+ */
+
+struct merge_source;
+
+/**
+ * Give the next batch of @a src in pos and end. pos == end means
+ * the source is over.
+ * @retval 0 Success.
+ * @retval -1 Error.
+ */
+typedef int (*merge_next_f)(struct merge_source *src);
+
+/** Sorted sequence, read by batches. */
+struct merge_source {
+    /** Current batch. */
+    const int *pos;
+    const int *end;
+    /** Called when the batch is over, NULL if it was the last. */
+    merge_next_f next;
+};
+
+/**
+ * Consume @a count merged integers from @a batch.
+ * @retval 0 Success.
+ * @retval -1 Error, the merge stops.
+ */
+typedef int (*merge_sink_f)(void *ctx, const int *batch, size_t count);
+
+/**
+ * Merge @a count sources. Output is collected into @a batch of
+ * @a batch_size integers and given to @a sink whenever it is full,
+ * and once more at the end. Equal integers go in the source order.
+ * @retval 0 Success.
+ * @retval -1 A source or the sink failed, or no memory.
+ */
+int
+merge_k(struct merge_source **srcs, int count, int *batch,
+        size_t batch_size, merge_sink_f sink, void *ctx);
+
+#endif /* MERGE_INCLUDED */
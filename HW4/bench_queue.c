@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "mpmc_ring.h"
+#include "thread_pool.h"
+
+// Contention benchmark of the pool task queue: the mutex protected list,
+// which the pool used to have, against the lock-free ring.
+// Every thread pushes a task and pops one, as a pool thread pushing subtasks does.
+// Usage: bench_queue [-n tasks per thread] [-t max threads]
+
+struct node {
+	struct node *next;
+};
+
+struct list_queue {
+	struct node *head;
+	struct node *tail;
+	int size;
+	pthread_mutex_t lock;
+};
+
+static void list_push(struct list_queue *q, struct node *n) {
+	pthread_mutex_lock(&q->lock);
+	n->next = NULL;
+	if (q->size == 0) {
+		q->head = n;
+	} else {
+		q->tail->next = n;
+	}
+	q->tail = n;
+	q->size++;
+	pthread_mutex_unlock(&q->lock);
+}
+
+static struct node *list_pop(struct list_queue *q) {
+	pthread_mutex_lock(&q->lock);
+	struct node *n = NULL;
+	if (q->size > 0) {
+		n = q->head;
+		q->head = n->next;
+		q->size--;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return n;
+}
+
+static struct list_queue list;
+static struct mpmc_ring ring;
+static int tasks_per_thread;
+static atomic_int ready_count;
+static atomic_bool go;
+
+static unsigned long long get_time_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void wait_start() {
+	atomic_fetch_add(&ready_count, 1);
+	while (!atomic_load(&go)) sched_yield();
+}
+
+static void *list_worker(void *arg) {
+	struct node *n = arg;
+	wait_start();
+	for (int i = 0; i < tasks_per_thread; i++) {
+		list_push(&list, n);
+		// another thread may have taken ours, any task will do
+		while ((n = list_pop(&list)) == NULL) sched_yield();
+	}
+	return NULL;
+}
+
+static void *ring_worker(void *arg) {
+	struct node *n = arg;
+	wait_start();
+	for (int i = 0; i < tasks_per_thread; i++) {
+		mpmc_ring_push(&ring, n);
+		while ((n = mpmc_ring_pop(&ring)) == NULL) sched_yield();
+	}
+	return NULL;
+}
+
+// run the threads together and return tasks per second
+static double run(void *(*worker)(void *), int thread_count) {
+	pthread_t threads[thread_count];
+	struct node nodes[thread_count];
+	atomic_store(&ready_count, 0);
+	atomic_store(&go, false);
+	for (int i = 0; i < thread_count; i++) {
+		pthread_create(&threads[i], NULL, worker, &nodes[i]);
+	}
+	while (atomic_load(&ready_count) < thread_count) sched_yield();
+	unsigned long long start = get_time_ns();
+	atomic_store(&go, true);
+	for (int i = 0; i < thread_count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	unsigned long long duration = get_time_ns() - start;
+	return (double) tasks_per_thread * thread_count * 1e9 / duration;
+}
+
+int main(int argc, char *argv[]) {
+	tasks_per_thread = 200000;
+	int max_threads = TPOOL_MAX_THREADS;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			tasks_per_thread = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			max_threads = atoi(argv[++i]);
+		}
+	}
+	if (tasks_per_thread <= 0 || max_threads <= 0) {
+		printf("Usage: bench_queue [-n tasks per thread] [-t max threads]\n");
+		return 1;
+	}
+
+	memset(&list, 0, sizeof(list));
+	pthread_mutex_init(&list.lock, NULL);
+	if (mpmc_ring_create(&ring, TPOOL_MAX_TASKS) != 0) {
+		printf("No memory for the ring\n");
+		return 1;
+	}
+
+	printf("%7s %16s %16s %8s\n", "threads", "list tasks/s", "ring tasks/s", "speedup");
+	for (int t = 1; t <= max_threads; t++) {
+		double list_rate = run(list_worker, t);
+		double ring_rate = run(ring_worker, t);
+		printf("%7d %16.0f %16.0f %7.2fx\n", t, list_rate, ring_rate, ring_rate / list_rate);
+	}
+
+	mpmc_ring_destroy(&ring);
+	pthread_mutex_destroy(&list.lock);
+	return 0;
+}
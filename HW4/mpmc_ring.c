@@ -0,0 +1,109 @@
+#include "mpmc_ring.h"
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+int
+mpmc_ring_create(struct mpmc_ring *ring, size_t capacity) {
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+	ring->cells = malloc(size * sizeof(struct mpmc_cell));
+	if (ring->cells == NULL)
+		return -1;
+	for (size_t i = 0; i < size; i++)
+		atomic_init(&ring->cells[i].seq, i);
+	ring->mask = size - 1;
+	atomic_init(&ring->push_pos, 0);
+	atomic_init(&ring->pop_pos, 0);
+	return 0;
+}
+
+void
+mpmc_ring_destroy(struct mpmc_ring *ring) {
+	free(ring->cells);
+	ring->cells = NULL;
+}
+
+bool
+mpmc_ring_push(struct mpmc_ring *ring, void *data) {
+	size_t pos = atomic_load_explicit(&ring->push_pos, memory_order_relaxed);
+	struct mpmc_cell *cell;
+	for (;;) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+		if (diff == 0) {
+			/* The cell is free in this lap - claim it. */
+			if (atomic_compare_exchange_weak_explicit(&ring->push_pos, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			/* The consumer of the previous lap has not taken it yet. */
+			return false;
+		} else {
+			pos = atomic_load_explicit(&ring->push_pos, memory_order_relaxed);
+		}
+	}
+	cell->data = data;
+	atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+	return true;
+}
+
+bool
+mpmc_ring_push_n(struct mpmc_ring *ring, void **data, size_t count) {
+	size_t size = ring->mask + 1;
+	size_t pos = atomic_load_explicit(&ring->push_pos, memory_order_relaxed);
+	do {
+		size_t pop = atomic_load_explicit(&ring->pop_pos, memory_order_acquire);
+		/* A stale pos can be behind pop, the CAS fails for it then. */
+		intptr_t used = (intptr_t) (pos - pop);
+		if (used < 0)
+			used = 0;
+		if ((size_t) used + count > size)
+			return false;
+	} while (!atomic_compare_exchange_weak_explicit(&ring->push_pos, &pos, pos + count,
+							memory_order_relaxed, memory_order_relaxed));
+	for (size_t i = 0; i < count; i++) {
+		struct mpmc_cell *cell = &ring->cells[(pos + i) & ring->mask];
+		/*
+		 * The consumer of the previous lap has claimed the cell, but
+		 * may not have freed it yet. It is a matter of a few
+		 * instructions, unless it is preempted.
+		 */
+		while (atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + i)
+			sched_yield();
+		cell->data = data[i];
+		atomic_store_explicit(&cell->seq, pos + i + 1, memory_order_release);
+	}
+	return true;
+}
+
+void *
+mpmc_ring_pop(struct mpmc_ring *ring) {
+	size_t pos = atomic_load_explicit(&ring->pop_pos, memory_order_relaxed);
+	struct mpmc_cell *cell;
+	for (;;) {
+		cell = &ring->cells[pos & ring->mask];
+		size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&ring->pop_pos, &pos, pos + 1,
+								  memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&ring->pop_pos, memory_order_relaxed);
+		}
+	}
+	void *data = cell->data;
+	/* Free the cell for the producer of the next lap. */
+	atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+	return data;
+}
+
+bool
+mpmc_ring_is_empty(struct mpmc_ring *ring) {
+	return atomic_load(&ring->push_pos) == atomic_load(&ring->pop_pos);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue of pointers,
+ * Dmitry Vyukov's design. Every cell has a sequence number, which
+ * tells whether the cell is free for a producer or filled for a
+ * consumer of the current lap. A push or a pop is one CAS on its
+ * position, so neither producers nor consumers ever take a lock.
+ */
+
+struct mpmc_cell {
+	atomic_size_t seq;
+	void *data;
+};
+
+enum {
+	MPMC_CACHE_LINE = 64,
+};
+
+struct mpmc_ring {
+	struct mpmc_cell *cells;
+	size_t mask;
+	/* Producers and consumers do not share a cache line. */
+	char pad0[MPMC_CACHE_LINE];
+	atomic_size_t push_pos;
+	char pad1[MPMC_CACHE_LINE - sizeof(atomic_size_t)];
+	atomic_size_t pop_pos;
+	char pad2[MPMC_CACHE_LINE - sizeof(atomic_size_t)];
+};
+
+/**
+ * Create an empty ring for at least @a capacity elements. The size
+ * is rounded up to a power of 2.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+int
+mpmc_ring_create(struct mpmc_ring *ring, size_t capacity);
+
+/** Free the cells. The ring must not be used anymore. */
+void
+mpmc_ring_destroy(struct mpmc_ring *ring);
+
+/** Append @a data, not NULL. False, if the ring is full. */
+bool
+mpmc_ring_push(struct mpmc_ring *ring, void *data);
+
+/**
+ * Append @a count elements of @a data with one CAS for all of them.
+ * The cells are filled in order, consumers see them one by one as
+ * they are stored. False and nothing is pushed, if they do not fit.
+ */
+bool
+mpmc_ring_push_n(struct mpmc_ring *ring, void **data, size_t count);
+
+/**
+ * Take the oldest element. NULL, if the ring is empty, or its next
+ * element is claimed by a producer but not yet stored.
+ */
+void *
+mpmc_ring_pop(struct mpmc_ring *ring);
+
+/**
+ * True, if nothing has been pushed since the last pop. Unlike
+ * mpmc_ring_pop(), an element being stored right now counts.
+ */
+bool
+mpmc_ring_is_empty(struct mpmc_ring *ring);
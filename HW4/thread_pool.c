@@ -1,16 +1,41 @@
+// for the thread affinity
+#define _GNU_SOURCE
 #include "thread_pool.h"
+#include "mpmc_ring.h"
+#include "ws_deque.h"
+#include "time_hist.h"
 #include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
 #include "stdlib.h"
 #include <stdatomic.h>
-#include <math.h>
 #include <errno.h>
 #include <unistd.h>
-#include <sys/time.h>
+#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 enum {
 	TPOOL_STATUS_IN_POOL = 1,
 	TPOOL_STATUS_RUNNING = 2,
-	TPOOL_STATUS_FINISHED = 3
+	TPOOL_STATUS_FINISHED = 3,
+	TPOOL_STATUS_MASK = 3,
+	// flags in the same word as the state, so a flag set and a state change can not miss each other
+	TPOOL_STATUS_DETACHED = 4,
+	// a joining thread sleeps on the word, the finishing one has to wake it
+	TPOOL_STATUS_WAITED = 8,
+};
+
+// where the task memory comes from
+enum {
+	TPOOL_TASK_MALLOC,
+	TPOOL_TASK_SLAB,
+	TPOOL_TASK_EMBEDDED,
 };
 
 struct thread_task {
@@ -18,18 +43,117 @@ struct thread_task {
 	void *arg;
 
 	/* PUT HERE OTHER MEMBERS */
+	// TPOOL_STATUS_* state and flags, also the futex word of the join
 	atomic_int status;
-	atomic_bool detach;
-	pthread_mutex_t mutex;
-	pthread_cond_t is_finish;
-	struct thread_task *next;
+	int origin;
+	// pool the task is pushed to
+	struct thread_pool *pool;
+	// pool whose slab the task is from
+	struct thread_pool *owner;
+	// next free task of the slab
+	struct thread_task *next_free;
 	void *result;
+	// continuations waiting for the task, task_deps_closed once it is done
+	_Atomic(struct task_edge *) dependents;
+	int priority;
+	// node the task is better run on, -1 if any
+	int node;
+	// the task is due this long after the push, 0 if it has no deadline
+	uint64_t timeout_ns;
+	// CLOCK_MONOTONIC time of the last push
+	uint64_t push_ns;
+};
+
+// a dependency of a continuation on one of its inputs, in the list of the input
+struct task_edge {
+	struct task_edge *next;
+	struct task_node *node;
+};
+
+// a continuation with its inputs, freed by the last one of them done
+struct task_node {
+	// inputs not yet done plus one for the creator
+	atomic_int ref_count;
+	// inputs to wait for more, it is scheduled at 0
+	atomic_int wait_count;
+	// then - the result of the input is the argument of the continuation
+	bool is_then;
+	struct thread_task *dependent;
+	struct task_edge edges[];
+};
+
+// the end of the dependents of a done task, the new ones are scheduled right away
+static struct task_edge task_deps_closed;
+
+static_assert(sizeof(struct thread_task) <= sizeof(struct thread_task_storage), "thread_task_storage is too small");
+
+enum {
+	// tasks pushed by a thread beyond this go to the global queue
+	TPOOL_DEQUE_SIZE = 4096,
+	// a thread idle for this long exits, a new one is started when the work comes back
+	TPOOL_IDLE_TIMEOUT_MS = 1000,
+	// tasks allocated at once for the free list of a pool
+	TPOOL_SLAB_SIZE = 256,
+	// a worker gives the tasks it has freed back to the pool by this many, under one lock
+	TPOOL_FREE_BATCH = 64,
+	// every this many takes a worker starts from the next priority in turn, so the low ones do not starve
+	TPOOL_AGING_PERIOD = 8,
+};
+
+// a task run by a thread
+struct trace_event {
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	int priority;
+};
+
+struct task_slab {
+	struct task_slab *next;
+	struct thread_task tasks[TPOOL_SLAB_SIZE];
 };
 
-struct queue {
-	struct thread_task *head;
-	struct thread_task *tail;
-	int size;
+// states of a thread slot, protected by idle_lock
+enum {
+	TPOOL_THREAD_NONE = 0,
+	TPOOL_THREAD_RUNNING,
+	TPOOL_THREAD_IDLE,
+	// the thread has returned and must be joined before the slot is used again
+	TPOOL_THREAD_EXITED,
+};
+
+// a thread slot of the pool, with the deque of the tasks pushed by its thread
+struct thread_worker {
+	struct thread_pool *pool;
+	int thread_id;
+	struct ws_deque deque;
+	unsigned rand_state;
+	int state;
+	// set by the pusher which has taken the worker from the idle stack
+	bool is_woken;
+	pthread_cond_t wakeup;
+	// slab tasks of the pool deleted by this thread, not yet given back
+	struct thread_task *free_tasks;
+	int free_count;
+	unsigned take_count;
+	// stats of the thread, written by it only
+	// queue wait of the tasks by priority
+	struct time_hist waits[TPOOL_PRIORITY_COUNT];
+	struct time_hist runs;
+	// tasks run, counted even with the stats off
+	atomic_ullong task_count;
+	// tasks taken from the own deque and stolen from the others
+	atomic_ullong local_count;
+	atomic_ullong steal_count;
+	atomic_ullong park_count;
+	atomic_ullong busy_ns;
+	// lifetime of the exited threads of the slot and the start of the current one, under idle_lock
+	unsigned long long alive_ns;
+	uint64_t start_ns;
+	// the last trace_capacity tasks run, NULL if not traced
+	struct trace_event *trace;
+	atomic_ullong trace_count;
+	// node of the thread, -1 if the pool is not NUMA aware, set before the thread is started
+	int node;
 };
 
 struct thread_pool {
@@ -37,186 +161,1077 @@ struct thread_pool {
 
 	/* PUT HERE OTHER MEMBERS */
 	int max_thread_count;
-	struct queue *task_queue;
-	int thread_count;
-//    int *threads_status;
-	atomic_int *threads_status;
+	// tasks by priority, of the normal one only those pushed not by the pool threads
+	struct mpmc_ring task_queue[TPOOL_PRIORITY_COUNT];
+	// protects the deadline heap
+	pthread_mutex_t deadline_lock;
+	// tasks with a deadline, a binary heap with the earliest deadline on top
+	struct thread_task **deadlines;
+	int deadline_capacity;
+	// heap size for the workers, which check it without the lock
+	atomic_int deadline_count;
+	// placement of the threads, changed only while the pool has no threads
+	cpu_set_t cpus;
+	bool has_cpus;
+	bool is_numa;
+	// node of each CPU, NULL until a topology is set or detected
+	int *cpu_nodes;
+	int cpu_count;
+	int node_count;
+	// normal priority tasks with a node hint, by node, NULL if the pool is not NUMA aware
+	struct mpmc_ring *node_queues;
+	// the time is measured for the stats, a clock read per push, take and run
+	atomic_bool is_stats;
+	int trace_capacity;
+	// threads started and exited, under idle_lock
+	unsigned long long spawn_count;
+	unsigned long long exit_count;
+	struct thread_worker *workers;
+	// alive threads, pool threads push too, so it is atomic
+	atomic_int thread_count;
 	atomic_int task_count;
-	pthread_mutex_t queue_lock;
-	pthread_mutex_t status_lock;
+	// tasks pushed and not yet taken by a thread
+	atomic_int queued_count;
+	// protects the thread states, the idle stack and is_stopping
+	pthread_mutex_t idle_lock;
+	// parked threads, the last parked one is woken first - its cache is the warmest
+	struct thread_worker **idle;
+	int idle_top;
+	// idle_top for the pushers, which check it without the lock
+	atomic_int idle_count;
+	bool is_stopping;
+	// protects the free tasks and the slab list
+	pthread_mutex_t free_lock;
+	struct thread_task *free_tasks;
+	struct task_slab *slabs;
 };
 
-void queue_push(struct queue *queue, struct thread_task *task) {
-	if (queue->size == 0) {
-		queue->head = task;
-	} else {
-		queue->tail->next = task;
+// a counter with a single writer, it needs no read-modify-write
+static void counter_add(atomic_ullong *counter, unsigned long long value) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// worker of the current thread, NULL if it is not a pool thread
+static __thread struct thread_worker *this_worker = NULL;
+
+// threads in thread_task_join_any(), the finishing threads bump any_finish_seq and wake them while there are any
+static atomic_int any_waiter_count;
+static atomic_int any_finish_seq;
+
+static void futex_wait(atomic_int *word, int value, const struct timespec *timeout) {
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake_all(atomic_int *word) {
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static bool deadline_before(const struct thread_task *a, const struct thread_task *b) {
+	return a->push_ns + a->timeout_ns < b->push_ns + b->timeout_ns;
+}
+
+// false if there is no memory for the task
+static bool deadline_push(struct thread_pool *pool, struct thread_task *task) {
+	pthread_mutex_lock(&pool->deadline_lock);
+	int i = atomic_load_explicit(&pool->deadline_count, memory_order_relaxed);
+	if (i == pool->deadline_capacity) {
+		int capacity = i > 0 ? i * 2 : 64;
+		struct thread_task **deadlines = realloc(pool->deadlines, capacity * sizeof(deadlines[0]));
+		if (deadlines == NULL) {
+			pthread_mutex_unlock(&pool->deadline_lock);
+			return false;
+		}
+		pool->deadlines = deadlines;
+		pool->deadline_capacity = capacity;
 	}
-	queue->tail = task;
-	queue->size++;
+	for (; i > 0 && deadline_before(task, pool->deadlines[(i - 1) / 2]); i = (i - 1) / 2)
+		pool->deadlines[i] = pool->deadlines[(i - 1) / 2];
+	pool->deadlines[i] = task;
+	atomic_fetch_add(&pool->deadline_count, 1);
+	pthread_mutex_unlock(&pool->deadline_lock);
+	return true;
 }
 
-struct thread_task *queue_pop(struct queue *queue) {
-	if (queue->size == 0) return NULL;
-	struct thread_task *task = queue->head;
-	queue->head = task->next;
-	queue->size--;
+static struct thread_task *deadline_pop(struct thread_pool *pool) {
+	if (atomic_load(&pool->deadline_count) == 0) return NULL;
+	pthread_mutex_lock(&pool->deadline_lock);
+	int count = atomic_load_explicit(&pool->deadline_count, memory_order_relaxed);
+	if (count == 0) {
+		pthread_mutex_unlock(&pool->deadline_lock);
+		return NULL;
+	}
+	struct thread_task *task = pool->deadlines[0];
+	struct thread_task *last = pool->deadlines[--count];
+	int i = 0;
+	for (;;) {
+		int child = 2 * i + 1;
+		if (child >= count) break;
+		if (child + 1 < count && deadline_before(pool->deadlines[child + 1], pool->deadlines[child])) child++;
+		if (!deadline_before(pool->deadlines[child], last)) break;
+		pool->deadlines[i] = pool->deadlines[child];
+		i = child;
+	}
+	pool->deadlines[i] = last;
+	atomic_fetch_sub(&pool->deadline_count, 1);
+	pthread_mutex_unlock(&pool->deadline_lock);
 	return task;
 }
 
-struct thread_args {
-	struct thread_pool *pool;
-	int thread_id;
+// a normal priority task: the own deque first, then the own node, the global queue,
+// then steal from the other workers, and take the tasks of the other nodes last
+static struct thread_task *worker_take_normal(struct thread_worker *worker) {
+	struct thread_pool *pool = worker->pool;
+	struct thread_task *task = ws_deque_pop(&worker->deque);
+	if (task != NULL) counter_add(&worker->local_count, 1);
+	if (task == NULL && worker->node >= 0) task = mpmc_ring_pop(&pool->node_queues[worker->node]);
+	if (task == NULL) task = mpmc_ring_pop(&pool->task_queue[TPOOL_PRIORITY_NORMAL]);
+	worker->rand_state = worker->rand_state * 1103515245 + 12345;
+	int start = (worker->rand_state >> 16) % pool->max_thread_count;
+	for (int i = 0; task == NULL && i < pool->max_thread_count; i++) {
+		struct thread_worker *victim = &pool->workers[(start + i) % pool->max_thread_count];
+		if (victim != worker) task = ws_deque_steal(&victim->deque);
+		if (task != NULL) counter_add(&worker->steal_count, 1);
+	}
+	// a node with no threads is served too
+	for (int i = 0; task == NULL && pool->node_queues != NULL && i < pool->node_count; i++) {
+		if (i != worker->node) task = mpmc_ring_pop(&pool->node_queues[i]);
+	}
+	return task;
+}
+
+// the queue classes in the order of urgency: the deadlines, then the priorities
+enum {
+	TPOOL_CLASS_DEADLINE = 0,
+	TPOOL_CLASS_COUNT = TPOOL_PRIORITY_COUNT + 1,
 };
 
-void *thread_func(void *arguments) {
-	struct thread_args *args = (struct thread_args *) arguments;
+static struct thread_task *worker_take_class(struct thread_worker *worker, int class) {
+	if (class == TPOOL_CLASS_DEADLINE) return deadline_pop(worker->pool);
+	int priority = class - 1;
+	if (priority == TPOOL_PRIORITY_NORMAL) return worker_take_normal(worker);
+	return mpmc_ring_pop(&worker->pool->task_queue[priority]);
+}
 
-//    pthread_mutex_lock(&args->pool->status_lock);
-//    args->pool->threads_status[args->thread_id] = 2;
-//    pthread_mutex_unlock(&args->pool->status_lock);
-	atomic_store(args->pool->threads_status + args->thread_id, 2);
+// take a task: the deadlines first, earliest one first, then by priority
+static struct thread_task *worker_take_task(struct thread_worker *worker) {
+	struct thread_pool *pool = worker->pool;
+	// once in a while the search starts from a less urgent class, from each in turn, so none starves
+	int first = 0;
+	if (++worker->take_count % TPOOL_AGING_PERIOD == 0)
+		first = 1 + worker->take_count / TPOOL_AGING_PERIOD % (TPOOL_CLASS_COUNT - 1);
+	struct thread_task *task = NULL;
+	for (int i = 0; task == NULL && i < TPOOL_CLASS_COUNT; i++)
+		task = worker_take_class(worker, (first + i) % TPOOL_CLASS_COUNT);
+	if (task == NULL) return NULL;
+	atomic_fetch_sub(&pool->queued_count, 1);
+	// the tasks pushed while the stats were off have no push time
+	if (task->push_ns != 0 && atomic_load_explicit(&pool->is_stats, memory_order_relaxed)) {
+		uint64_t now = now_ns();
+		time_hist_add(&worker->waits[task->priority], now > task->push_ns ? now - task->push_ns : 0);
+	}
+	return task;
+}
 
-	for (;;) {
-		pthread_mutex_lock(&args->pool->queue_lock);
-		if (args->pool->task_queue->size == 0) {
-			pthread_mutex_unlock(&args->pool->queue_lock);
-			break;
-		}
-		struct thread_task *task = queue_pop(args->pool->task_queue);
-		pthread_mutex_unlock(&args->pool->queue_lock);
+// true if a task is queued anywhere in the pool
+static bool pool_has_tasks(struct thread_pool *pool) {
+	if (atomic_load(&pool->deadline_count) > 0) return true;
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; i++) {
+		if (!mpmc_ring_is_empty(&pool->task_queue[i])) return true;
+	}
+	for (int i = 0; pool->node_queues != NULL && i < pool->node_count; i++) {
+		if (!mpmc_ring_is_empty(&pool->node_queues[i])) return true;
+	}
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		if (!ws_deque_is_empty(&pool->workers[i].deque)) return true;
+	}
+	return false;
+}
 
-		atomic_store(&task->status, TPOOL_STATUS_RUNNING);
-		task->result = task->function(task->arg);
+static struct task_edge *task_deps_done(struct thread_task *task);
+static void task_edge_run(struct thread_pool *pool, struct task_edge *edge);
 
-		pthread_mutex_lock(&task->mutex);
-		if (atomic_load(&task->detach)) {
-			atomic_store(&task->status, 0);
-			pthread_mutex_unlock(&task->mutex);
-			thread_task_delete(task);
-		} else {
-			atomic_store(&task->status, TPOOL_STATUS_FINISHED);
-			pthread_cond_broadcast(&task->is_finish);
-			pthread_mutex_unlock(&task->mutex);
+static void task_run(struct thread_pool *pool, struct thread_task *task) {
+	// IN_POOL -> RUNNING, keeping the flags set meanwhile
+	atomic_fetch_add(&task->status, TPOOL_STATUS_RUNNING - TPOOL_STATUS_IN_POOL);
+	// a continuation can be run by any thread in a full pool, only the pool threads have the stats
+	struct thread_worker *worker = this_worker;
+	if (worker != NULL && worker->pool != pool) worker = NULL;
+	if (worker != NULL) counter_add(&worker->task_count, 1);
+	bool is_stats = worker != NULL && atomic_load_explicit(&pool->is_stats, memory_order_relaxed);
+	if (!is_stats && (worker == NULL || worker->trace == NULL)) {
+		task->result = task->function(task->arg);
+	} else {
+		uint64_t start_ns = now_ns();
+		task->result = task->function(task->arg);
+		uint64_t duration_ns = now_ns() - start_ns;
+		if (is_stats) {
+			counter_add(&worker->busy_ns, duration_ns);
+			time_hist_add(&worker->runs, duration_ns);
+		}
+		// the trace is not changed while the pool has tasks, and this one is not done yet
+		if (worker->trace != NULL) {
+			unsigned long long n = atomic_load_explicit(&worker->trace_count, memory_order_relaxed);
+			struct trace_event *event = &worker->trace[n % pool->trace_capacity];
+			event->start_ns = start_ns;
+			event->duration_ns = duration_ns;
+			event->priority = task->priority;
+			atomic_store_explicit(&worker->trace_count, n + 1, memory_order_relaxed);
 		}
-		atomic_fetch_sub(&args->pool->task_count, 1);
 	}
+	// the continuations are in the pool before this task leaves it, so the pool is not deleted under them
+	struct task_edge *left = task_deps_done(task);
+	// the task leaves the pool before it is joined, so the pool can be deleted right after the join
+	atomic_fetch_sub(&pool->task_count, 1);
 
-//    pthread_mutex_lock(&args->pool->status_lock);
-//    args->pool->threads_status[args->thread_id] = 1;
-//    pthread_mutex_unlock(&args->pool->status_lock);
-	atomic_store(args->pool->threads_status + args->thread_id, 1);
+	int prev = atomic_exchange(&task->status, TPOOL_STATUS_FINISHED);
+	if (prev & TPOOL_STATUS_DETACHED) {
+		atomic_store(&task->status, 0);
+		thread_task_delete(task);
+	} else if (prev & TPOOL_STATUS_WAITED) {
+		futex_wake_all(&task->status);
+	}
+	// pairs with the waiter count increment, either the waiter sees the task finished or it is woken
+	if (atomic_load(&any_waiter_count) > 0) {
+		atomic_fetch_add(&any_finish_seq, 1);
+		futex_wake_all(&any_finish_seq);
+	}
+	// after the task is finished, so they can join it, and they keep the pool from being deleted till done
+	while (left != NULL) {
+		struct task_edge *next = left->next;
+		task_edge_run(pool, left);
+		left = next;
+	}
+}
+
+static void idle_remove(struct thread_pool *pool, struct thread_worker *worker) {
+	int i = 0;
+	while (pool->idle[i] != worker) i++;
+	for (; i < pool->idle_top - 1; i++) pool->idle[i] = pool->idle[i + 1];
+	pool->idle_top--;
+	atomic_fetch_sub(&pool->idle_count, 1);
+}
 
-	free(arguments);
+// park the worker until a push wakes it up, with idle_lock held
+// false if the pool is being deleted or the thread has been idle for too long, it is not counted anymore then
+static bool worker_park(struct thread_worker *worker) {
+	struct thread_pool *pool = worker->pool;
+	if (pool->is_stopping) {
+		atomic_fetch_sub(&pool->thread_count, 1);
+		return false;
+	}
+	worker->state = TPOOL_THREAD_IDLE;
+	worker->is_woken = false;
+	pool->idle[pool->idle_top++] = worker;
+	atomic_fetch_add(&pool->idle_count, 1);
+	// a pusher which has not seen this thread idle has made its task visible before
+	if (pool_has_tasks(pool)) {
+		idle_remove(pool, worker);
+		worker->state = TPOOL_THREAD_RUNNING;
+		return true;
+	}
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += TPOOL_IDLE_TIMEOUT_MS / 1000;
+	deadline.tv_nsec += (TPOOL_IDLE_TIMEOUT_MS % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_nsec -= 1000000000;
+		deadline.tv_sec += 1;
+	}
+	counter_add(&worker->park_count, 1);
+	int rc = 0;
+	while (!worker->is_woken && !pool->is_stopping && rc != ETIMEDOUT)
+		rc = pthread_cond_timedwait(&worker->wakeup, &pool->idle_lock, &deadline);
+	worker->state = TPOOL_THREAD_RUNNING;
+	if (worker->is_woken) return true;
+	// a pusher must see either a free thread slot or this thread idle, it starts a thread then
+	atomic_fetch_sub(&pool->thread_count, 1);
+	idle_remove(pool, worker);
+	return false;
+}
+
+void *thread_func(void *arguments) {
+	struct thread_worker *worker = (struct thread_worker *) arguments;
+	struct thread_pool *pool = worker->pool;
+	this_worker = worker;
+
+	for (;;) {
+		struct thread_task *task;
+		while ((task = worker_take_task(worker)) != NULL) task_run(pool, task);
+		pthread_mutex_lock(&pool->idle_lock);
+		if (!worker_park(worker)) break;
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
+	worker->state = TPOOL_THREAD_EXITED;
+	worker->alive_ns += now_ns() - worker->start_ns;
+	pool->exit_count++;
+	pthread_mutex_unlock(&pool->idle_lock);
 	return NULL;
 }
 
+// the CPUs of a node allowed for the pool
+static void node_cpus(const struct thread_pool *pool, int node, cpu_set_t *set) {
+	CPU_ZERO(set);
+	for (int cpu = 0; cpu < pool->cpu_count; cpu++) {
+		if (pool->cpu_nodes[cpu] == node && (!pool->has_cpus || CPU_ISSET(cpu, &pool->cpus))) CPU_SET(cpu, set);
+	}
+}
+
+// the nodes with allowed CPUs get the threads in turn
+static int worker_node(const struct thread_pool *pool, int thread_id) {
+	int node_count = 0;
+	cpu_set_t set;
+	for (int node = 0; node < pool->node_count; node++) {
+		node_cpus(pool, node, &set);
+		if (CPU_COUNT(&set) > 0) node_count++;
+	}
+	if (node_count == 0) return -1;
+	int n = thread_id % node_count;
+	for (int node = 0; node < pool->node_count; node++) {
+		node_cpus(pool, node, &set);
+		if (CPU_COUNT(&set) > 0 && n-- == 0) return node;
+	}
+	return -1;
+}
+
+// start the thread of a slot, placed as the pool options say, with idle_lock held
+static int worker_start(struct thread_worker *worker) {
+	struct thread_pool *pool = worker->pool;
+	pthread_t *thread = &pool->threads[worker->thread_id];
+	worker->node = pool->is_numa ? worker_node(pool, worker->thread_id) : -1;
+	worker->start_ns = now_ns();
+	pool->spawn_count++;
+	cpu_set_t set;
+	if (worker->node >= 0) {
+		node_cpus(pool, worker->node, &set);
+	} else if (pool->has_cpus) {
+		set = pool->cpus;
+	} else {
+		return pthread_create(thread, NULL, thread_func, (void *) worker);
+	}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	int rc = pthread_create(thread, &attr, thread_func, (void *) worker);
+	pthread_attr_destroy(&attr);
+	// the placement is a hint: CPUs which are offline or not given to the process are refused
+	if (rc == EINVAL) rc = pthread_create(thread, NULL, thread_func, (void *) worker);
+	return rc;
+}
+
+// wake up to @a count idle threads, or start new ones while the queued tasks are more than the woken threads
+static void pool_wake_or_spawn(struct thread_pool *pool, int count) {
+	pthread_mutex_lock(&pool->idle_lock);
+	int slot = 0;
+	for (int i = 0; i < count; i++) {
+		if (pool->idle_top > 0) {
+			struct thread_worker *worker = pool->idle[--pool->idle_top];
+			atomic_fetch_sub(&pool->idle_count, 1);
+			worker->is_woken = true;
+			pthread_cond_signal(&worker->wakeup);
+			continue;
+		}
+		if (atomic_load(&pool->queued_count) <= i || pool->is_stopping) break;
+		struct thread_worker *worker = NULL;
+		for (; slot < pool->max_thread_count; slot++) {
+			worker = &pool->workers[slot];
+			if (worker->state == TPOOL_THREAD_NONE || worker->state == TPOOL_THREAD_EXITED) break;
+		}
+		if (slot == pool->max_thread_count) break;
+		// an exited thread has returned already or is about to, the join is short
+		if (worker->state == TPOOL_THREAD_EXITED) pthread_join(pool->threads[slot], NULL);
+		worker->state = TPOOL_THREAD_RUNNING;
+		atomic_fetch_add(&pool->thread_count, 1);
+		if (worker_start(worker) != 0) {
+			pool->spawn_count--;
+			worker->state = TPOOL_THREAD_NONE;
+			atomic_fetch_sub(&pool->thread_count, 1);
+			break;
+		}
+		slot++;
+	}
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
 int
 thread_pool_new(int max_thread_count, struct thread_pool **pool) {
 	if (max_thread_count <= 0 || max_thread_count > TPOOL_MAX_THREADS) return TPOOL_ERR_INVALID_ARGUMENT;
 	*pool = malloc(sizeof(struct thread_pool));
 	(*pool)->max_thread_count = max_thread_count;
-	(*pool)->task_queue = malloc(sizeof(struct queue));
-	(*pool)->task_queue->size = 0;
-	(*pool)->thread_count = 0;
-	(*pool)->threads = calloc(max_thread_count, sizeof(pthread_t));
-//    (*pool)->threads_status = calloc(max_thread_count, sizeof(int));
-	(*pool)->threads_status = calloc(max_thread_count, sizeof(atomic_int));
-	pthread_mutex_init(&(*pool)->queue_lock, NULL);
-	pthread_mutex_init(&(*pool)->status_lock, NULL);
+	// a ring of TPOOL_MAX_TASKS never gets full, task_count is checked before a push
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; i++) mpmc_ring_create(&(*pool)->task_queue[i], TPOOL_MAX_TASKS);
+	pthread_mutex_init(&(*pool)->deadline_lock, NULL);
+	(*pool)->deadlines = NULL;
+	(*pool)->deadline_capacity = 0;
+	atomic_init(&(*pool)->deadline_count, 0);
+	(*pool)->has_cpus = false;
+	(*pool)->is_numa = false;
+	(*pool)->cpu_nodes = NULL;
+	(*pool)->cpu_count = 0;
+	(*pool)->node_count = 0;
+	(*pool)->node_queues = NULL;
+	atomic_init(&(*pool)->is_stats, true);
+	(*pool)->trace_capacity = 0;
+	(*pool)->spawn_count = 0;
+	(*pool)->exit_count = 0;
+	atomic_init(&(*pool)->thread_count, 0);
 	atomic_init(&(*pool)->task_count, 0);
-//    for (int i = 0; i < max_thread_count; i++) (*pool)->threads_status[i] = 0;
-	for (int i = 0; i < max_thread_count; i++) atomic_init((*pool)->threads_status + i, 0);
+	atomic_init(&(*pool)->queued_count, 0);
+	(*pool)->threads = calloc(max_thread_count, sizeof(pthread_t));
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	(*pool)->workers = calloc(max_thread_count, sizeof(struct thread_worker));
+	for (int i = 0; i < max_thread_count; i++) {
+		struct thread_worker *worker = &(*pool)->workers[i];
+		worker->pool = *pool;
+		worker->thread_id = i;
+		worker->rand_state = i + 1;
+		worker->state = TPOOL_THREAD_NONE;
+		worker->node = -1;
+		ws_deque_create(&worker->deque, TPOOL_DEQUE_SIZE);
+		pthread_cond_init(&worker->wakeup, &attr);
+	}
+	pthread_condattr_destroy(&attr);
+	pthread_mutex_init(&(*pool)->idle_lock, NULL);
+	pthread_mutex_init(&(*pool)->free_lock, NULL);
+	(*pool)->free_tasks = NULL;
+	(*pool)->slabs = NULL;
+	(*pool)->idle = calloc(max_thread_count, sizeof(struct thread_worker *));
+	(*pool)->idle_top = 0;
+	atomic_init(&(*pool)->idle_count, 0);
+	(*pool)->is_stopping = false;
 	return 0;
 }
 
 int
 thread_pool_thread_count(const struct thread_pool *pool) {
-	return pool->thread_count;
+	return atomic_load(&pool->thread_count);
+}
+
+static void pool_numa_destroy(struct thread_pool *pool) {
+	if (pool->node_queues == NULL) return;
+	for (int i = 0; i < pool->node_count; i++) mpmc_ring_destroy(&pool->node_queues[i]);
+	free(pool->node_queues);
+	pool->node_queues = NULL;
+}
+
+static int pool_numa_create(struct thread_pool *pool) {
+	pool->node_queues = calloc(pool->node_count, sizeof(struct mpmc_ring));
+	if (pool->node_queues == NULL) return -1;
+	for (int i = 0; i < pool->node_count; i++) {
+		if (mpmc_ring_create(&pool->node_queues[i], TPOOL_MAX_TASKS) != 0) {
+			pool->node_count = i;
+			pool_numa_destroy(pool);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// the placement options can not change under the threads, they are placed when started
+static bool pool_is_unused(struct thread_pool *pool) {
+	return atomic_load(&pool->thread_count) == 0 && atomic_load(&pool->task_count) == 0;
+}
+
+// read the nodes of the CPUs from sysfs, all CPUs are of node 0 if there is no NUMA
+// the table stays NULL when there is no memory for it
+static int topology_detect(struct thread_pool *pool) {
+	pool->cpu_nodes = malloc(CPU_SETSIZE * sizeof(int));
+	if (pool->cpu_nodes == NULL) return -1;
+	pool->cpu_count = CPU_SETSIZE;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) pool->cpu_nodes[cpu] = -1;
+	pool->node_count = 0;
+	for (int node = 0;; node++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *file = fopen(path, "r");
+		if (file == NULL) break;
+		char list[4096];
+		if (fgets(list, sizeof(list), file) != NULL) {
+			// ranges like 0-3,8-11
+			char *pos = list;
+			while (*pos >= '0' && *pos <= '9') {
+				long first = strtol(pos, &pos, 10), last = first;
+				if (*pos == '-') last = strtol(pos + 1, &pos, 10);
+				for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) pool->cpu_nodes[cpu] = node;
+				if (*pos == ',') pos++;
+			}
+		}
+		fclose(file);
+		pool->node_count = node + 1;
+	}
+	if (pool->node_count > 0) return 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) pool->cpu_nodes[cpu] = 0;
+	pool->node_count = 1;
+	return 0;
+}
+
+int
+thread_pool_set_cpus(struct thread_pool *pool, const int *cpus, int cpu_count) {
+	for (int i = 0; i < cpu_count; i++) {
+		if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	pthread_mutex_lock(&pool->idle_lock);
+	if (!pool_is_unused(pool)) {
+		pthread_mutex_unlock(&pool->idle_lock);
+		return TPOOL_ERR_HAS_THREADS;
+	}
+	CPU_ZERO(&pool->cpus);
+	for (int i = 0; i < cpu_count; i++) CPU_SET(cpus[i], &pool->cpus);
+	pool->has_cpus = cpu_count > 0;
+	pthread_mutex_unlock(&pool->idle_lock);
+	return 0;
+}
+
+int
+thread_pool_set_topology(struct thread_pool *pool, const int *cpu_nodes, int cpu_count) {
+	if (cpu_count <= 0 || cpu_count > CPU_SETSIZE) return TPOOL_ERR_INVALID_ARGUMENT;
+	int node_count = 0;
+	for (int cpu = 0; cpu < cpu_count; cpu++) {
+		if (cpu_nodes[cpu] < 0) return TPOOL_ERR_INVALID_ARGUMENT;
+		if (cpu_nodes[cpu] >= node_count) node_count = cpu_nodes[cpu] + 1;
+	}
+	pthread_mutex_lock(&pool->idle_lock);
+	if (!pool_is_unused(pool)) {
+		pthread_mutex_unlock(&pool->idle_lock);
+		return TPOOL_ERR_HAS_THREADS;
+	}
+	// the old topology is kept, if there is no memory for the new one
+	int *nodes = malloc(cpu_count * sizeof(int));
+	if (nodes == NULL) {
+		pthread_mutex_unlock(&pool->idle_lock);
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	for (int cpu = 0; cpu < cpu_count; cpu++) nodes[cpu] = cpu_nodes[cpu];
+	pool_numa_destroy(pool);
+	free(pool->cpu_nodes);
+	pool->cpu_nodes = nodes;
+	pool->cpu_count = cpu_count;
+	pool->node_count = node_count;
+	int rc = 0;
+	if (pool->is_numa && pool_numa_create(pool) != 0) {
+		pool->is_numa = false;
+		rc = TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	pthread_mutex_unlock(&pool->idle_lock);
+	return rc;
+}
+
+int
+thread_pool_set_numa(struct thread_pool *pool, bool is_numa) {
+	pthread_mutex_lock(&pool->idle_lock);
+	if (!pool_is_unused(pool)) {
+		pthread_mutex_unlock(&pool->idle_lock);
+		return TPOOL_ERR_HAS_THREADS;
+	}
+	pool_numa_destroy(pool);
+	pool->is_numa = false;
+	int rc = 0;
+	if (is_numa) {
+		if ((pool->cpu_nodes != NULL || topology_detect(pool) == 0) && pool_numa_create(pool) == 0) {
+			pool->is_numa = true;
+		} else {
+			rc = TPOOL_ERR_INVALID_ARGUMENT;
+		}
+	}
+	pthread_mutex_unlock(&pool->idle_lock);
+	return rc;
+}
+
+int
+thread_pool_cpu_node(struct thread_pool *pool, int cpu) {
+	pthread_mutex_lock(&pool->idle_lock);
+	int node = -1;
+	if ((pool->cpu_nodes != NULL || topology_detect(pool) == 0) && cpu >= 0 && cpu < pool->cpu_count)
+		node = pool->cpu_nodes[cpu];
+	pthread_mutex_unlock(&pool->idle_lock);
+	return node;
+}
+
+int
+thread_pool_current_node(void) {
+	return this_worker != NULL ? this_worker->node : -1;
 }
 
 int
 thread_pool_delete(struct thread_pool *pool) {
 	if (atomic_load(&pool->task_count) > 0) return TPOOL_ERR_HAS_TASKS;
+	pthread_mutex_lock(&pool->idle_lock);
+	pool->is_stopping = true;
+	for (int i = 0; i < pool->max_thread_count; i++) pthread_cond_signal(&pool->workers[i].wakeup);
+	pthread_mutex_unlock(&pool->idle_lock);
+	// no push can start a thread anymore, so the states are not changed but by the exiting threads
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		pthread_mutex_lock(&pool->idle_lock);
+		int state = pool->workers[i].state;
+		pthread_mutex_unlock(&pool->idle_lock);
+		if (state != TPOOL_THREAD_NONE) pthread_join(pool->threads[i], NULL);
+	}
 	free(pool->threads);
-	free(pool->task_queue);
-	free(pool->threads_status);
-	pthread_mutex_destroy(&pool->queue_lock);
-	pthread_mutex_destroy(&pool->status_lock);
+	for (int i = 0; i < TPOOL_PRIORITY_COUNT; i++) mpmc_ring_destroy(&pool->task_queue[i]);
+	free(pool->deadlines);
+	pthread_mutex_destroy(&pool->deadline_lock);
+	pool_numa_destroy(pool);
+	free(pool->cpu_nodes);
+	for (int i = 0; i < pool->max_thread_count; i++) free(pool->workers[i].trace);
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		ws_deque_destroy(&pool->workers[i].deque);
+		pthread_cond_destroy(&pool->workers[i].wakeup);
+	}
+	free(pool->workers);
+	free(pool->idle);
+	pthread_mutex_destroy(&pool->idle_lock);
+	while (pool->slabs != NULL) {
+		struct task_slab *slab = pool->slabs;
+		pool->slabs = slab->next;
+		free(slab);
+	}
+	pthread_mutex_destroy(&pool->free_lock);
 	free(pool);
 	return 0;
 }
 
+// the deadlines need the push time always, the stats only if they are on
+static uint64_t task_push_ns(struct thread_pool *pool, struct thread_task *task) {
+	if (task->timeout_ns == 0 && !atomic_load_explicit(&pool->is_stats, memory_order_relaxed)) return 0;
+	return now_ns();
+}
+
+// a ring holds all TPOOL_MAX_TASKS, it is full only until a slow consumer frees its cell
+static void ring_push(struct mpmc_ring *ring, void *data) {
+	while (!mpmc_ring_push(ring, data)) sched_yield();
+}
+
+// put a task into its queue, with push_ns set
+static void pool_queue(struct thread_pool *pool, struct thread_task *task) {
+	if (task->timeout_ns != 0 && deadline_push(pool, task)) return;
+	// a busy node queue is just a hint lost, the task goes to the common queues then
+	if (task->priority == TPOOL_PRIORITY_NORMAL && task->node >= 0 && task->node < pool->node_count &&
+	    pool->node_queues != NULL && mpmc_ring_push(&pool->node_queues[task->node], task))
+		return;
+	// a subtask of a pool thread stays with it, the idle threads steal it if they can
+	if (task->priority == TPOOL_PRIORITY_NORMAL && this_worker != NULL && this_worker->pool == pool &&
+	    ws_deque_push(&this_worker->deque, task))
+		return;
+	ring_push(&pool->task_queue[task->priority], task);
+}
+
+// queue a task already counted in task_count
+static void pool_enqueue(struct thread_pool *pool, struct thread_task *task) {
+	task->pool = pool;
+	task->push_ns = task_push_ns(pool, task);
+	atomic_fetch_add(&pool->queued_count, 1);
+	pool_queue(pool, task);
+	// pairs with the idle_count increment of a parking thread, one of them sees the other
+	atomic_thread_fence(memory_order_seq_cst);
+	// all threads are busy - they will get to the task themselves, no lock is needed
+	if (atomic_load(&pool->idle_count) > 0 || atomic_load(&pool->thread_count) < pool->max_thread_count)
+		pool_wake_or_spawn(pool, 1);
+}
+
+static void time_stats_fill(struct thread_pool_time_stats *stats, const struct time_hist *hist) {
+	stats->count = atomic_load_explicit(&hist->count, memory_order_relaxed);
+	unsigned long long total_ns = atomic_load_explicit(&hist->total_ns, memory_order_relaxed);
+	stats->mean_ns = stats->count > 0 ? total_ns / stats->count : 0;
+	stats->max_ns = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+	stats->p50_ns = time_hist_quantile(hist, 0.5);
+	stats->p99_ns = time_hist_quantile(hist, 0.99);
+	stats->p999_ns = time_hist_quantile(hist, 0.999);
+}
+
+// merge the histograms of all threads, the one of @a offset in struct thread_worker
+static void time_stats_merge(const struct thread_pool *pool, size_t offset, struct time_hist *hist,
+			     struct thread_pool_time_stats *stats) {
+	memset(hist, 0, sizeof(*hist));
+	for (int i = 0; i < pool->max_thread_count; i++)
+		time_hist_merge(hist, (const struct time_hist *) ((const char *) &pool->workers[i] + offset));
+	time_stats_fill(stats, hist);
+}
+
+int
+thread_pool_wait_stats(const struct thread_pool *pool, int priority, struct thread_pool_time_stats *stats) {
+	if (priority < 0 || priority >= TPOOL_PRIORITY_COUNT) return TPOOL_ERR_INVALID_ARGUMENT;
+	// a few KB, too big for a stack of a coroutine
+	struct time_hist *hist = malloc(sizeof(struct time_hist));
+	if (hist == NULL) return TPOOL_ERR_INVALID_ARGUMENT;
+	time_stats_merge(pool, offsetof(struct thread_worker, waits) + priority * sizeof(struct time_hist), hist, stats);
+	free(hist);
+	return 0;
+}
+
+void
+thread_pool_set_stats(struct thread_pool *pool, bool is_stats) {
+	atomic_store(&pool->is_stats, is_stats);
+}
+
+void
+thread_pool_stats(struct thread_pool *pool, struct thread_pool_stats *stats) {
+	stats->task_count = atomic_load(&pool->task_count);
+	stats->queued_count = atomic_load(&pool->queued_count);
+	// the times are left zero without memory to merge them, the counters do not need it
+	struct time_hist *hist = malloc(sizeof(struct time_hist));
+	if (hist != NULL) {
+		for (int p = 0; p < TPOOL_PRIORITY_COUNT; p++)
+			time_stats_merge(pool, offsetof(struct thread_worker, waits) + p * sizeof(struct time_hist), hist,
+					 &stats->wait[p]);
+		time_stats_merge(pool, offsetof(struct thread_worker, runs), hist, &stats->run);
+		free(hist);
+	} else {
+		memset(stats->wait, 0, sizeof(stats->wait));
+		memset(&stats->run, 0, sizeof(stats->run));
+	}
+
+	uint64_t now = now_ns();
+	unsigned long long busy_ns = 0, alive_ns = 0;
+	pthread_mutex_lock(&pool->idle_lock);
+	stats->thread_count = atomic_load(&pool->thread_count);
+	stats->idle_count = pool->idle_top;
+	stats->spawn_count = pool->spawn_count;
+	stats->exit_count = pool->exit_count;
+	stats->worker_count = pool->max_thread_count;
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		struct thread_worker *worker = &pool->workers[i];
+		struct thread_pool_worker_stats *out = &stats->workers[i];
+		out->task_count = atomic_load_explicit(&worker->task_count, memory_order_relaxed);
+		out->local_count = atomic_load_explicit(&worker->local_count, memory_order_relaxed);
+		out->steal_count = atomic_load_explicit(&worker->steal_count, memory_order_relaxed);
+		out->park_count = atomic_load_explicit(&worker->park_count, memory_order_relaxed);
+		out->busy_ns = atomic_load_explicit(&worker->busy_ns, memory_order_relaxed);
+		out->alive_ns = worker->alive_ns;
+		if (worker->state == TPOOL_THREAD_RUNNING || worker->state == TPOOL_THREAD_IDLE)
+			out->alive_ns += now - worker->start_ns;
+		out->utilization = out->alive_ns > 0 ? (double) out->busy_ns / out->alive_ns : 0;
+		busy_ns += out->busy_ns;
+		alive_ns += out->alive_ns;
+	}
+	pthread_mutex_unlock(&pool->idle_lock);
+	stats->utilization = alive_ns > 0 ? (double) busy_ns / alive_ns : 0;
+}
+
+int
+thread_pool_trace_start(struct thread_pool *pool, int capacity) {
+	if (capacity < 0) return TPOOL_ERR_INVALID_ARGUMENT;
+	if (atomic_load(&pool->task_count) > 0) return TPOOL_ERR_HAS_TASKS;
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		struct thread_worker *worker = &pool->workers[i];
+		free(worker->trace);
+		worker->trace = capacity > 0 ? calloc(capacity, sizeof(struct trace_event)) : NULL;
+		atomic_store(&worker->trace_count, 0);
+	}
+	pool->trace_capacity = capacity;
+	return 0;
+}
+
+int
+thread_pool_trace_dump(struct thread_pool *pool, const char *path) {
+	if (pool->trace_capacity == 0) return TPOOL_ERR_INVALID_ARGUMENT;
+	if (atomic_load(&pool->task_count) > 0) return TPOOL_ERR_HAS_TASKS;
+	FILE *file = fopen(path, "w");
+	if (file == NULL) return TPOOL_ERR_INVALID_ARGUMENT;
+	// the Chrome trace format, opened by chrome://tracing or Perfetto
+	fprintf(file, "{\"traceEvents\":[");
+	const char *separator = "\n";
+	for (int i = 0; i < pool->max_thread_count; i++) {
+		struct thread_worker *worker = &pool->workers[i];
+		unsigned long long count = atomic_load(&worker->trace_count);
+		unsigned long long first = count > (unsigned long long) pool->trace_capacity ? count - pool->trace_capacity : 0;
+		for (unsigned long long n = first; n < count; n++) {
+			struct trace_event *event = &worker->trace[n % pool->trace_capacity];
+			fprintf(file, "%s{\"name\":\"task\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+				"\"args\":{\"priority\":%d}}", separator, i, event->start_ns / 1e3, event->duration_ns / 1e3,
+				event->priority);
+			separator = ",\n";
+		}
+	}
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0 ? 0 : TPOOL_ERR_INVALID_ARGUMENT;
+}
+
+// a task run before has its dependents closed, the new ones wait for the new run
+static void task_reopen(struct thread_task *task) {
+	struct task_edge *closed = &task_deps_closed;
+	atomic_compare_exchange_strong(&task->dependents, &closed, NULL);
+}
+
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task) {
-	if (atomic_load(&pool->task_count) == TPOOL_MAX_TASKS) return TPOOL_ERR_TOO_MANY_TASKS;
-	atomic_fetch_add(&pool->task_count, 1);
+	if (atomic_fetch_add(&pool->task_count, 1) >= TPOOL_MAX_TASKS) {
+		atomic_fetch_sub(&pool->task_count, 1);
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	}
+	task_reopen(task);
 	atomic_store(&task->status, TPOOL_STATUS_IN_POOL);
-	pthread_mutex_lock(&pool->queue_lock);
-	queue_push(pool->task_queue, task);
-	pthread_mutex_unlock(&pool->queue_lock);
+	pool_enqueue(pool, task);
+	return 0;
+}
 
-//    pthread_mutex_lock(&pool->status_lock);
-	for (int i = 0; i < pool->max_thread_count; i++) {
-//        if (pool->threads_status[i] < 2) {
-//            if (pool->threads_status[i] == 0) pool->thread_count++;
-		int status = atomic_load(pool->threads_status + i);
-		if (status < 2) {
-			if (status == 0) pool->thread_count++;
-			struct thread_args *args = malloc(sizeof(struct thread_args));
-			args->pool = pool;
-			args->thread_id = i;
-			pthread_create(&pool->threads[i], NULL, thread_func, (void *) args);
-			pthread_detach(pool->threads[i]);
-			break;
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks, int count) {
+	if (count <= 0) return count == 0 ? 0 : TPOOL_ERR_INVALID_ARGUMENT;
+	if (count > TPOOL_MAX_TASKS) return TPOOL_ERR_TOO_MANY_TASKS;
+	if (atomic_fetch_add(&pool->task_count, count) > TPOOL_MAX_TASKS - count) {
+		atomic_fetch_sub(&pool->task_count, count);
+		return TPOOL_ERR_TOO_MANY_TASKS;
+	}
+	uint64_t push_ns = atomic_load_explicit(&pool->is_stats, memory_order_relaxed) ? now_ns() : 0;
+	bool is_plain = true;
+	for (int i = 0; i < count; i++) {
+		task_reopen(tasks[i]);
+		atomic_store_explicit(&tasks[i]->status, TPOOL_STATUS_IN_POOL, memory_order_relaxed);
+		tasks[i]->pool = pool;
+		tasks[i]->push_ns = push_ns == 0 && tasks[i]->timeout_ns != 0 ? now_ns() : push_ns;
+		is_plain = is_plain && tasks[i]->priority == TPOOL_PRIORITY_NORMAL && tasks[i]->timeout_ns == 0 &&
+			   tasks[i]->node < 0;
+	}
+	atomic_fetch_add(&pool->queued_count, count);
+	if (is_plain) {
+		// the deque is filled first, as by single pushes, the rest goes to the global queue at once
+		int pushed = 0;
+		if (this_worker != NULL && this_worker->pool == pool) {
+			while (pushed < count && ws_deque_push(&this_worker->deque, tasks[pushed])) pushed++;
+		}
+		struct mpmc_ring *ring = &pool->task_queue[TPOOL_PRIORITY_NORMAL];
+		if (pushed < count && !mpmc_ring_push_n(ring, (void **) &tasks[pushed], count - pushed)) {
+			// the free cells are counted conservatively, one by one they do fit
+			for (; pushed < count; pushed++) ring_push(ring, tasks[pushed]);
 		}
+	} else {
+		for (int i = 0; i < count; i++) pool_queue(pool, tasks[i]);
 	}
-//    pthread_mutex_unlock(&pool->status_lock);
+	atomic_thread_fence(memory_order_seq_cst);
+	// a thread per task, as many as the pool has
+	if (atomic_load(&pool->idle_count) > 0 || atomic_load(&pool->thread_count) < pool->max_thread_count)
+		pool_wake_or_spawn(pool, count < pool->max_thread_count ? count : pool->max_thread_count);
 	return 0;
 }
 
+static void task_init(struct thread_task *task, int origin, thread_task_f function, void *arg) {
+	task->function = function;
+	task->arg = arg;
+	atomic_init(&task->status, 0);
+	task->origin = origin;
+	task->pool = NULL;
+	task->owner = NULL;
+	task->next_free = NULL;
+	atomic_init(&task->dependents, NULL);
+	task->priority = TPOOL_PRIORITY_NORMAL;
+	task->node = -1;
+	task->timeout_ns = 0;
+	task->push_ns = 0;
+}
+
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg) {
 	(*task) = malloc(sizeof(struct thread_task));
-	(*task)->function = function;
-	(*task)->arg = arg;
-	atomic_init(&(*task)->status, 0);
-	atomic_init(&(*task)->detach, false);
-	pthread_mutex_init(&(*task)->mutex, NULL);
-	pthread_cond_init(&(*task)->is_finish, NULL);
+	if (*task == NULL) return TPOOL_ERR_INVALID_ARGUMENT;
+	task_init(*task, TPOOL_TASK_MALLOC, function, arg);
+	return 0;
+}
+
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task, thread_task_f function, void *arg) {
+	pthread_mutex_lock(&pool->free_lock);
+	if (pool->free_tasks == NULL) {
+		struct task_slab *slab = malloc(sizeof(struct task_slab));
+		if (slab == NULL) {
+			pthread_mutex_unlock(&pool->free_lock);
+			return thread_task_new(task, function, arg);
+		}
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		for (int i = 0; i < TPOOL_SLAB_SIZE; i++) {
+			slab->tasks[i].next_free = pool->free_tasks;
+			pool->free_tasks = &slab->tasks[i];
+		}
+	}
+	*task = pool->free_tasks;
+	pool->free_tasks = (*task)->next_free;
+	pthread_mutex_unlock(&pool->free_lock);
+	task_init(*task, TPOOL_TASK_SLAB, function, arg);
+	(*task)->owner = pool;
+	return 0;
+}
+
+int
+thread_task_init(struct thread_task **task, struct thread_task_storage *storage, thread_task_f function, void *arg) {
+	*task = (struct thread_task *) storage;
+	task_init(*task, TPOOL_TASK_EMBEDDED, function, arg);
+	return 0;
+}
+
+// give a slab task back, a worker of its pool collects a batch first
+static void task_free(struct thread_task *task) {
+	struct thread_pool *pool = task->owner;
+	struct thread_worker *worker = this_worker;
+	if (worker != NULL && worker->pool == pool) {
+		task->next_free = worker->free_tasks;
+		worker->free_tasks = task;
+		if (++worker->free_count < TPOOL_FREE_BATCH) return;
+		task = worker->free_tasks;
+		worker->free_tasks = NULL;
+		worker->free_count = 0;
+	} else {
+		task->next_free = NULL;
+	}
+	struct thread_task *last = task;
+	while (last->next_free != NULL) last = last->next_free;
+	pthread_mutex_lock(&pool->free_lock);
+	last->next_free = pool->free_tasks;
+	pool->free_tasks = task;
+	pthread_mutex_unlock(&pool->free_lock);
+}
+
+int
+thread_task_set_priority(struct thread_task *task, int priority) {
+	if (priority < 0 || priority >= TPOOL_PRIORITY_COUNT) return TPOOL_ERR_INVALID_ARGUMENT;
+	if (atomic_load(&task->status) != 0) return TPOOL_ERR_TASK_IN_POOL;
+	task->priority = priority;
+	return 0;
+}
+
+int
+thread_task_set_node(struct thread_task *task, int node) {
+	if (node < -1) return TPOOL_ERR_INVALID_ARGUMENT;
+	if (atomic_load(&task->status) != 0) return TPOOL_ERR_TASK_IN_POOL;
+	task->node = node;
+	return 0;
+}
+
+int
+thread_task_set_deadline(struct thread_task *task, double timeout) {
+	if (atomic_load(&task->status) != 0) return TPOOL_ERR_TASK_IN_POOL;
+	// as in a timed join, years are no deadline, and a due one is the most urgent possible
+	if (!(timeout < 1e9)) {
+		task->timeout_ns = 0;
+	} else {
+		task->timeout_ns = timeout > 1e-9 ? (uint64_t) (timeout * 1e9) : 1;
+	}
 	return 0;
 }
 
 bool
 thread_task_is_finished(const struct thread_task *task) {
-	return atomic_load(&task->status) == TPOOL_STATUS_FINISHED;
+	return (atomic_load(&task->status) & TPOOL_STATUS_MASK) == TPOOL_STATUS_FINISHED;
 }
 
 bool
 thread_task_is_running(const struct thread_task *task) {
-	return atomic_load(&task->status) == TPOOL_STATUS_RUNNING;
+	return (atomic_load(&task->status) & TPOOL_STATUS_MASK) == TPOOL_STATUS_RUNNING;
+}
+
+// sleep on the status word until the task is finished or @a deadline_ns of CLOCK_MONOTONIC, 0 is none
+static bool task_wait(struct thread_task *task, uint64_t deadline_ns) {
+	for (;;) {
+		int status = atomic_load(&task->status);
+		if ((status & TPOOL_STATUS_MASK) == TPOOL_STATUS_FINISHED) return true;
+		if (!(status & TPOOL_STATUS_WAITED)) {
+			if (!atomic_compare_exchange_weak(&task->status, &status, status | TPOOL_STATUS_WAITED)) continue;
+			status |= TPOOL_STATUS_WAITED;
+		}
+		if (deadline_ns == 0) {
+			futex_wait(&task->status, status, NULL);
+			continue;
+		}
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		uint64_t now_ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+		if (now_ns >= deadline_ns) return false;
+		struct timespec timeout;
+		timeout.tv_sec = (deadline_ns - now_ns) / 1000000000;
+		timeout.tv_nsec = (deadline_ns - now_ns) % 1000000000;
+		futex_wait(&task->status, status, &timeout);
+	}
 }
 
 int
 thread_task_join(struct thread_task *task, void **result) {
 	if (atomic_load(&task->status) == 0) return TPOOL_ERR_TASK_NOT_PUSHED;
 
-	pthread_mutex_lock(&task->mutex);
-	if (atomic_load(&task->status) != TPOOL_STATUS_FINISHED)
-		pthread_cond_wait(&task->is_finish, &task->mutex);
-	pthread_mutex_unlock(&task->mutex);
+	// a pool thread does not block, it runs the queued tasks until the joined one is done
+	struct thread_worker *worker = this_worker;
+	if (worker != NULL && worker->pool == task->pool) {
+		while (!thread_task_is_finished(task)) {
+			struct thread_task *other = worker_take_task(worker);
+			if (other == NULL) break;
+			task_run(worker->pool, other);
+		}
+	}
+	task_wait(task, 0);
 
 	atomic_store(&task->status, 0);
 	*result = task->result;
 	return 0;
 }
 
+int
+thread_task_join_all(struct thread_task **tasks, int count, void **results) {
+	if (count < 0) return TPOOL_ERR_INVALID_ARGUMENT;
+	for (int i = 0; i < count; i++) {
+		if (atomic_load(&tasks[i]->status) == 0) return TPOOL_ERR_TASK_NOT_PUSHED;
+	}
+	for (int i = 0; i < count; i++) {
+		void *result;
+		thread_task_join(tasks[i], &result);
+		if (results != NULL) results[i] = result;
+	}
+	return 0;
+}
+
+// index of a finished task, -1 if none is, -2 if none is pushed
+static int task_find_finished(struct thread_task **tasks, int count) {
+	int rc = -2;
+	for (int i = 0; i < count; i++) {
+		int status = atomic_load(&tasks[i]->status);
+		if ((status & TPOOL_STATUS_MASK) == TPOOL_STATUS_FINISHED) return i;
+		if (status != 0) rc = -1;
+	}
+	return rc;
+}
+
+int
+thread_task_join_any(struct thread_task **tasks, int count, int *index, void **result) {
+	if (count <= 0) return TPOOL_ERR_INVALID_ARGUMENT;
+	int i = task_find_finished(tasks, count);
+	// a pool thread runs the queued tasks meanwhile, same as in a join
+	struct thread_worker *worker = this_worker;
+	while (i == -1 && worker != NULL) {
+		struct thread_task *other = worker_take_task(worker);
+		if (other == NULL) break;
+		task_run(worker->pool, other);
+		i = task_find_finished(tasks, count);
+	}
+	if (i == -1) {
+		atomic_fetch_add(&any_waiter_count, 1);
+		for (;;) {
+			int seq = atomic_load(&any_finish_seq);
+			i = task_find_finished(tasks, count);
+			if (i != -1) break;
+			futex_wait(&any_finish_seq, seq, NULL);
+		}
+		atomic_fetch_sub(&any_waiter_count, 1);
+	}
+	if (i == -2) return TPOOL_ERR_TASK_NOT_PUSHED;
+
+	atomic_store(&tasks[i]->status, 0);
+	*index = i;
+	*result = tasks[i]->result;
+	return 0;
+}
+
 int
 thread_task_delete(struct thread_task *task) {
 	if (atomic_load(&task->status) != 0) return TPOOL_ERR_TASK_IN_POOL;
-	pthread_cond_destroy(&task->is_finish);
-	pthread_mutex_destroy(&task->mutex);
-	free(task);
+	if (task->origin == TPOOL_TASK_MALLOC) {
+		free(task);
+	} else if (task->origin == TPOOL_TASK_SLAB) {
+		task_free(task);
+	}
 	return 0;
 }
 
@@ -225,32 +1240,19 @@ thread_task_delete(struct thread_task *task) {
 int
 thread_task_timed_join(struct thread_task *task, double timeout, void **result) {
 	if (atomic_load(&task->status) == 0) return TPOOL_ERR_TASK_NOT_PUSHED;
-	if (timeout <= 0) return TPOOL_ERR_TIMEOUT;
-
-	pthread_mutex_lock(&task->mutex);
-
-	struct timeval now;
-	struct timespec ts;
-	gettimeofday(&now, 0);
 
-//    struct timespec ts;
-//    clock_gettime(CLOCK_REALTIME, &ts);
-	double int_part = 0;
-	long nano_part = modf(timeout, &int_part) * 1000000000;
-	ts.tv_sec = now.tv_sec + int_part;
-	ts.tv_nsec = now.tv_usec * 1000 + nano_part;
-	if (ts.tv_nsec >= 1000000000) {
-		ts.tv_nsec -= 1000000000;
-		ts.tv_sec += 1;
+	bool is_finished = thread_task_is_finished(task);
+	if (!is_finished && timeout > 0) {
+		// a timeout of years is an infinite one, and it does not overflow the deadline
+		uint64_t deadline_ns = 0;
+		if (timeout < 1e9) {
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			deadline_ns = now.tv_sec * 1000000000ull + now.tv_nsec + (uint64_t) (timeout * 1e9);
+		}
+		is_finished = task_wait(task, deadline_ns);
 	}
-//    ts.tv_sec += int_part;
-//    ts.tv_nsec += nano_part;
-
-	int rc = 0;
-	if (atomic_load(&task->status) != TPOOL_STATUS_FINISHED)
-		rc = pthread_cond_timedwait(&task->is_finish, &task->mutex, &ts);
-	pthread_mutex_unlock(&task->mutex);
-	if (rc == ETIMEDOUT) {
+	if (!is_finished) {
 		return TPOOL_ERR_TIMEOUT;
 	}
 
@@ -267,16 +1269,253 @@ thread_task_timed_join(struct thread_task *task, double timeout, void **result)
 int
 thread_task_detach(struct thread_task *task) {
 	if (atomic_load(&task->status) == 0) return TPOOL_ERR_TASK_NOT_PUSHED;
-	pthread_mutex_lock(&task->mutex);
-	if (atomic_load(&task->status) == TPOOL_STATUS_FINISHED) {
+	int prev = atomic_fetch_or(&task->status, TPOOL_STATUS_DETACHED);
+	// finished before the flag was set - the pool thread has not seen it, delete here
+	if ((prev & TPOOL_STATUS_MASK) == TPOOL_STATUS_FINISHED) {
 		atomic_store(&task->status, 0);
-		pthread_mutex_unlock(&task->mutex);
 		thread_task_delete(task);
-	} else {
-		atomic_store(&task->detach, true);
-		pthread_mutex_unlock(&task->mutex);
 	}
 	return 0;
 }
 
 #endif
+
+// a continuation is scheduled by the thread which has done its last input, it does not wait for the pool limit.
+// False - a full pool can not refuse it, nobody would push it again, the caller runs it
+static bool task_schedule(struct thread_pool *pool, struct thread_task *task) {
+	task->pool = pool;
+	if (atomic_fetch_add(&pool->task_count, 1) < TPOOL_MAX_TASKS) {
+		pool_enqueue(pool, task);
+		return true;
+	}
+	return false;
+}
+
+// an input of the edge is done with @a result. True - the continuation is left to the caller, the node with it
+static bool task_edge_done(struct thread_pool *pool, void *result, struct task_edge *edge) {
+	struct task_node *node = edge->node;
+	if (atomic_fetch_sub(&node->wait_count, 1) == 1) {
+		if (node->is_then) node->dependent->arg = result;
+		if (!task_schedule(pool, node->dependent)) return true;
+	}
+	if (atomic_fetch_sub(&node->ref_count, 1) == 1) free(node);
+	return false;
+}
+
+// run the continuation left by task_edge_done(), it is already counted in the pool
+static void task_edge_run(struct thread_pool *pool, struct task_edge *edge) {
+	struct task_node *node = edge->node;
+	task_run(pool, node->dependent);
+	if (atomic_fetch_sub(&node->ref_count, 1) == 1) free(node);
+}
+
+// schedule the continuations of @a task, the ones a full pool leaves to this thread are returned
+static struct task_edge *task_deps_done(struct thread_task *task) {
+	struct task_edge *edge = atomic_exchange(&task->dependents, &task_deps_closed);
+	struct task_edge *left = NULL;
+	while (edge != NULL) {
+		// the edge is freed with its node after it is done, till then it links the left ones
+		struct task_edge *next = edge->next;
+		if (task_edge_done(task->pool, task->result, edge)) {
+			edge->next = left;
+			left = edge;
+		}
+		edge = next;
+	}
+	return left;
+}
+
+// add the edge to the dependents of @a input, or satisfy it if the input is done
+static void task_depend(struct thread_task *input, struct task_edge *edge) {
+	struct task_edge *head = atomic_load(&input->dependents);
+	do {
+		if (head == &task_deps_closed) {
+			if (task_edge_done(input->pool, input->result, edge)) task_edge_run(input->pool, edge);
+			return;
+		}
+		edge->next = head;
+	} while (!atomic_compare_exchange_weak(&input->dependents, &head, edge));
+}
+
+// create a continuation of @a inputs, scheduled after @a wait_count of them are done
+static int task_continue(struct thread_task **inputs, int count, int wait_count, bool is_then,
+			 thread_task_f function, void *arg, struct thread_task **next) {
+	if (count <= 0) return TPOOL_ERR_INVALID_ARGUMENT;
+	// a published edge can not be taken back, so all the memory is got before the first one
+	struct task_node *node = malloc(sizeof(struct task_node) + count * sizeof(struct task_edge));
+	if (node == NULL) return TPOOL_ERR_INVALID_ARGUMENT;
+	if (thread_task_new(next, function, arg) != 0) {
+		free(node);
+		return TPOOL_ERR_INVALID_ARGUMENT;
+	}
+	atomic_init(&node->ref_count, count + 1);
+	atomic_init(&node->wait_count, wait_count);
+	node->is_then = is_then;
+	node->dependent = *next;
+	node->dependent->priority = inputs[0]->priority;
+	// it is joined and detached as a pushed task, while it waits for the inputs too
+	atomic_store(&node->dependent->status, TPOOL_STATUS_IN_POOL);
+	for (int i = 0; i < count; i++) {
+		node->edges[i].node = node;
+		task_depend(inputs[i], &node->edges[i]);
+	}
+	if (atomic_fetch_sub(&node->ref_count, 1) == 1) free(node);
+	return 0;
+}
+
+int
+thread_task_then(struct thread_task *task, thread_task_f function, struct thread_task **next) {
+	return task_continue(&task, 1, 1, true, function, NULL, next);
+}
+
+int
+thread_task_when_all(struct thread_task **tasks, int count, thread_task_f function, void *arg,
+		     struct thread_task **next) {
+	return task_continue(tasks, count, count, false, function, arg, next);
+}
+
+int
+thread_task_when_any(struct thread_task **tasks, int count, thread_task_f function, void *arg,
+		     struct thread_task **next) {
+	return task_continue(tasks, count, 1, false, function, arg, next);
+}
+
+// all the chunking policy of the parallel loops
+enum {
+	// a static loop gives every thread this many chunks, so a slow thread does not hold up the rest for long
+	TPOOL_STATIC_CHUNKS = 4,
+	// an adaptive loop splits only on demand, a small leaf costs just a check of the own deque
+	TPOOL_ADAPTIVE_CHUNKS = 64,
+};
+
+struct range_loop {
+	struct thread_pool *pool;
+	long grain;
+	bool is_static;
+	thread_pool_range_f map;
+	thread_pool_join_f join;
+	void *ctx;
+};
+
+// right half of a range, given to the other threads
+struct range_part {
+	struct thread_task_storage storage;
+	struct thread_task *task;
+	struct range_loop *loop;
+	long begin;
+	long end;
+};
+
+// grain of a range of @a count items, when the caller gives none
+static long range_grain(const struct range_loop *loop, long count) {
+	// the caller thread takes part in the work too
+	long chunks = (long) loop->pool->max_thread_count + 1;
+	chunks *= loop->is_static ? TPOOL_STATIC_CHUNKS : TPOOL_ADAPTIVE_CHUNKS;
+	long grain = (count + chunks - 1) / chunks;
+	return grain > 0 ? grain : 1;
+}
+
+// lazy binary splitting: split when the previously given part is taken, nobody has work to steal then
+static bool range_split_wanted(const struct range_loop *loop) {
+	if (loop->is_static) return true;
+	struct thread_worker *worker = this_worker;
+	if (worker != NULL && worker->pool == loop->pool) return ws_deque_is_empty(&worker->deque);
+	return mpmc_ring_is_empty(&loop->pool->task_queue[TPOOL_PRIORITY_NORMAL]);
+}
+
+static void range_merge(const struct range_loop *loop, void **result, bool *has_result, void *value) {
+	if (loop->join == NULL) return;
+	*result = *has_result ? loop->join(*result, value, loop->ctx) : value;
+	*has_result = true;
+}
+
+static void *range_part_f(void *arg);
+
+// run [begin, end) giving its right halves away, and join them, the results are joined left to right
+static void *range_run(struct range_loop *loop, long begin, long end) {
+	int max_parts = 1;
+	for (long n = (end - begin) / loop->grain; n > 1; n >>= 1) max_parts++;
+	struct range_part parts[max_parts];
+	int part_count = 0;
+	void *result = NULL;
+	bool has_result = false;
+
+	while (end - begin > loop->grain) {
+		if (!range_split_wanted(loop) || part_count == max_parts) {
+			range_merge(loop, &result, &has_result, loop->map(begin, begin + loop->grain, loop->ctx));
+			begin += loop->grain;
+			continue;
+		}
+		long mid = begin + (end - begin) / 2;
+		struct range_part *part = &parts[part_count];
+		part->loop = loop;
+		part->begin = mid;
+		part->end = end;
+		thread_task_init(&part->task, &part->storage, range_part_f, part);
+		// a full pool does not stop the loop, the range is just not split
+		if (thread_pool_push_task(loop->pool, part->task) != 0) {
+			max_parts = part_count;
+			continue;
+		}
+		part_count++;
+		end = mid;
+	}
+	range_merge(loop, &result, &has_result, loop->map(begin, end, loop->ctx));
+	// the last given part is the closest one to the own range
+	while (part_count > 0) {
+		void *value;
+		thread_task_join(parts[--part_count].task, &value);
+		range_merge(loop, &result, &has_result, value);
+	}
+	return result;
+}
+
+static void *range_part_f(void *arg) {
+	struct range_part *part = (struct range_part *) arg;
+	return range_run(part->loop, part->begin, part->end);
+}
+
+static int range_loop_run(struct range_loop *loop, long begin, long end, long grain, void **result) {
+	if (begin > end || grain < 0) return TPOOL_ERR_INVALID_ARGUMENT;
+	loop->grain = grain > 0 ? grain : range_grain(loop, end - begin);
+	void *value = range_run(loop, begin, end);
+	if (result != NULL) *result = value;
+	return 0;
+}
+
+// a loop body has no result, it is wrapped into a map
+struct range_for {
+	thread_pool_for_f fn;
+	void *ctx;
+};
+
+static void *range_for_map(long begin, long end, void *ctx) {
+	struct range_for *range_for = (struct range_for *) ctx;
+	if (begin < end) range_for->fn(begin, end, range_for->ctx);
+	return NULL;
+}
+
+static int range_for_run(struct thread_pool *pool, long begin, long end, long grain, bool is_static,
+			 thread_pool_for_f fn, void *ctx) {
+	struct range_for range_for = {fn, ctx};
+	struct range_loop loop = {pool, 0, is_static, range_for_map, NULL, &range_for};
+	return range_loop_run(&loop, begin, end, grain, NULL);
+}
+
+int
+thread_pool_parallel_for(struct thread_pool *pool, long begin, long end, long grain, thread_pool_for_f fn, void *ctx) {
+	return range_for_run(pool, begin, end, grain, false, fn, ctx);
+}
+
+int
+thread_pool_parallel_for_static(struct thread_pool *pool, long begin, long end, long grain, thread_pool_for_f fn,
+				void *ctx) {
+	return range_for_run(pool, begin, end, grain, true, fn, ctx);
+}
+
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, long begin, long end, long grain, thread_pool_range_f map,
+			    thread_pool_join_f join, void *ctx, void **result) {
+	struct range_loop loop = {pool, 0, false, map, join, ctx};
+	return range_loop_run(&loop, begin, end, grain, result);
+}
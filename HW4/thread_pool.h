@@ -37,6 +37,22 @@ enum thread_poool_errcode {
 	TPOOL_ERR_TASK_IN_POOL,
 	TPOOL_ERR_NOT_IMPLEMENTED,
 	TPOOL_ERR_TIMEOUT,
+	TPOOL_ERR_HAS_THREADS,
+};
+
+/**
+ * Priorities of tasks. A pool thread takes the tasks with a
+ * deadline first, then by priority. Every few tasks it starts from
+ * one of the priorities instead, each of them in turn, and goes
+ * on to the less urgent ones, then wraps around to the deadlines.
+ * So the normal and low tasks are taken first at times, and none
+ * of them starves.
+ */
+enum thread_task_priority {
+	TPOOL_PRIORITY_HIGH,
+	TPOOL_PRIORITY_NORMAL,
+	TPOOL_PRIORITY_LOW,
+	TPOOL_PRIORITY_COUNT,
 };
 
 /** Thread pool API. */
@@ -57,7 +73,8 @@ thread_pool_new(int max_thread_count, struct thread_pool **pool);
 
 /**
  * How many threads are created by this pool. Can be less than
- * max.
+ * max. Threads are started only when the queued tasks outnumber
+ * the idle ones, and a thread idle for a while exits.
  * @param pool Thread pool to get thread count of.
  * @retval Thread count.
  */
@@ -65,7 +82,76 @@ int
 thread_pool_thread_count(const struct thread_pool *pool);
 
 /**
- * Delete @a pool, free its memory.
+ * Pin the pool threads to @a cpus. Only a pool with no threads and
+ * no tasks can be changed - its threads are placed when started.
+ * CPUs the process can not run on are ignored, a thread with none
+ * of its CPUs available runs unpinned.
+ * @param pool Pool to pin.
+ * @param cpus CPU numbers.
+ * @param cpu_count Number of the CPUs, 0 unpins the threads.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - a CPU number is out of range.
+ *     - TPOOL_ERR_HAS_THREADS - the pool has threads or tasks.
+ */
+int
+thread_pool_set_cpus(struct thread_pool *pool, const int *cpus, int cpu_count);
+
+/**
+ * Make the pool NUMA aware: its threads are spread over the NUMA
+ * nodes in turn, each is pinned to the CPUs of its node allowed by
+ * thread_pool_set_cpus(). A normal priority task with a node hint
+ * is taken by a thread of the node first, by the others only when
+ * they have nothing else to do. The topology is read from sysfs,
+ * unless it is set by thread_pool_set_topology(). Only a pool with
+ * no threads and no tasks can be changed.
+ * @param pool Pool to change.
+ * @param is_numa True to enable, false to disable.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no memory for the topology or
+ *       the node queues.
+ *     - TPOOL_ERR_HAS_THREADS - the pool has threads or tasks.
+ */
+int
+thread_pool_set_numa(struct thread_pool *pool, bool is_numa);
+
+/**
+ * Set the NUMA topology instead of the one of the machine, to
+ * simulate another machine, or to group the CPUs differently.
+ * Only a pool with no threads and no tasks can be changed.
+ * @param pool Pool to change.
+ * @param cpu_nodes Node of each CPU, from CPU 0.
+ * @param cpu_count Number of the CPUs.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no CPUs, a node is negative,
+ *       or no memory.
+ *     - TPOOL_ERR_HAS_THREADS - the pool has threads or tasks.
+ */
+int
+thread_pool_set_topology(struct thread_pool *pool, const int *cpu_nodes, int cpu_count);
+
+/**
+ * Node of @a cpu in the topology of @a pool, to give a task a hint
+ * by a CPU. -1 if the CPU is unknown.
+ */
+int
+thread_pool_cpu_node(struct thread_pool *pool, int cpu);
+
+/**
+ * Node of the current pool thread in a NUMA aware pool, -1 for
+ * other threads.
+ */
+int
+thread_pool_current_node(void);
+
+/**
+ * Delete @a pool, free its memory. The threads are stopped and
+ * joined.
  * @param pool Pool to delete.
  * @retval 0 Success.
  * @retval != Error code.
@@ -87,6 +173,138 @@ thread_pool_delete(struct thread_pool *pool);
 int
 thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
 
+/**
+ * Push @a count tasks into thread pool queue at once. The tasks
+ * are counted and queued with one atomic operation each, not per
+ * task, and a thread per task is woken, up to the pool size.
+ * Either all the tasks are pushed or none.
+ * @param pool Pool to push into.
+ * @param tasks Tasks to push.
+ * @param count Number of the tasks.
+ *
+ * @retval 0 Success.
+ * @retval != Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - count is negative.
+ *     - TPOOL_ERR_TOO_MANY_TASKS - the tasks do not fit into the
+ *       pool.
+ */
+int
+thread_pool_push_tasks(struct thread_pool *pool, struct thread_task **tasks, int count);
+
+/** Durations of the tasks, since the pool creation. */
+struct thread_pool_time_stats {
+	/** Tasks measured. */
+	unsigned long long count;
+	unsigned long long mean_ns;
+	unsigned long long max_ns;
+	/** Percentiles, rounded up by no more than 1/8. */
+	unsigned long long p50_ns;
+	unsigned long long p99_ns;
+	unsigned long long p999_ns;
+};
+
+/**
+ * Get the queue wait of the tasks of @a priority: from the push
+ * till a pool thread takes the task. The counters are updated by
+ * each thread on its own, the stats are not an atomic snapshot.
+ * @param pool Pool to get the stats of.
+ * @param priority Priority of the tasks.
+ * @param[out] stats Stats to fill.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such priority, or no memory.
+ */
+int
+thread_pool_wait_stats(const struct thread_pool *pool, int priority, struct thread_pool_time_stats *stats);
+
+/** Stats of a thread slot of a pool, of all threads it has had. */
+struct thread_pool_worker_stats {
+	/** Tasks run. */
+	unsigned long long task_count;
+	/** Tasks taken from the own queue of the thread. */
+	unsigned long long local_count;
+	/** Tasks stolen from the other threads. */
+	unsigned long long steal_count;
+	/** Times the thread went to sleep for the lack of tasks. */
+	unsigned long long park_count;
+	/** Time running tasks and time alive. */
+	unsigned long long busy_ns;
+	unsigned long long alive_ns;
+	/** busy_ns / alive_ns. */
+	double utilization;
+};
+
+/** Stats of a pool. */
+struct thread_pool_stats {
+	int thread_count;
+	int idle_count;
+	/** Tasks in the pool, and the ones of them not yet taken. */
+	int task_count;
+	int queued_count;
+	/** Threads started and exited for idleness or the deletion. */
+	unsigned long long spawn_count;
+	unsigned long long exit_count;
+	/** Busy time over alive time of all threads. */
+	double utilization;
+	/** Queue wait by priority. */
+	struct thread_pool_time_stats wait[TPOOL_PRIORITY_COUNT];
+	/** Run time of the tasks. */
+	struct thread_pool_time_stats run;
+	int worker_count;
+	struct thread_pool_worker_stats workers[TPOOL_MAX_THREADS];
+};
+
+/**
+ * Turn the time measurement on or off, it is on by default. Off,
+ * the pool does not read the clock, so the wait and run times and
+ * the busy time are not collected, the counters still are.
+ * @param pool Pool to change.
+ * @param is_stats True to turn on, false to turn off.
+ */
+void
+thread_pool_set_stats(struct thread_pool *pool, bool is_stats);
+
+/**
+ * Get the stats of @a pool. The counters are updated by each thread
+ * on its own, the stats are not an atomic snapshot. The wait and run
+ * times are zero, if there is no memory to merge them.
+ * @param pool Pool to get the stats of.
+ * @param[out] stats Stats to fill.
+ */
+void
+thread_pool_stats(struct thread_pool *pool, struct thread_pool_stats *stats);
+
+/**
+ * Start tracing the tasks run by @a pool: each thread keeps the
+ * last @a capacity tasks it has run, with their start and run
+ * time. A restart drops the collected trace.
+ * @param pool Pool to trace.
+ * @param capacity Tasks kept per thread, 0 stops the tracing.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - capacity is negative.
+ *     - TPOOL_ERR_HAS_TASKS - the pool has tasks.
+ */
+int
+thread_pool_trace_start(struct thread_pool *pool, int capacity);
+
+/**
+ * Write the trace of @a pool into a file in the Chrome trace event
+ * format, to view it in chrome://tracing or Perfetto.
+ * @param pool Pool to dump the trace of.
+ * @param path File to write.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - the pool is not traced, or
+ *       the file can not be written.
+ *     - TPOOL_ERR_HAS_TASKS - the pool has tasks.
+ */
+int
+thread_pool_trace_dump(struct thread_pool *pool, const char *path);
+
 /** Thread pool task API. */
 
 /**
@@ -95,11 +313,98 @@ thread_pool_push_task(struct thread_pool *pool, struct thread_task *task);
  * @param function Function to run by this task.
  * @param arg Argument for @a function.
  *
- * @retval Always 0.
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no memory for the task.
  */
 int
 thread_task_new(struct thread_task **task, thread_task_f function, void *arg);
 
+/**
+ * Create a task in memory of @a pool: the tasks are cut from big
+ * slabs and deleted ones are reused, with no malloc() per task.
+ * The task can be pushed into any pool, but must be deleted before
+ * @a pool is.
+ * @param pool Pool to take the task memory from.
+ * @param[out] task Pointer to store result task object.
+ * @param function Function to run by this task.
+ * @param arg Argument for @a function.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code, as of thread_task_new().
+ */
+int
+thread_pool_task_new(struct thread_pool *pool, struct thread_task **task,
+		     thread_task_f function, void *arg);
+
+/** Memory for a task embedded into an object of the caller. */
+struct thread_task_storage {
+	_Alignas(16) char data[128];
+};
+
+/**
+ * Create a task in @a storage, provided by the caller. Deletion
+ * frees nothing, the storage can be reused for another task after
+ * it. It must live until the task is deleted, or finished if it
+ * is detached.
+ * @param[out] task Pointer to store result task object.
+ * @param storage Memory of the task.
+ * @param function Function to run by this task.
+ * @param arg Argument for @a function.
+ *
+ * @retval Always 0.
+ */
+int
+thread_task_init(struct thread_task **task, struct thread_task_storage *storage,
+		 thread_task_f function, void *arg);
+
+/**
+ * Set priority of @a task for its next pushes, TPOOL_PRIORITY_NORMAL
+ * by default. The normal tasks pushed by a pool thread are kept by
+ * it, the high and low ones are shared with all threads right away.
+ * A continuation gets the priority of its first input.
+ * @param task Task to set priority of.
+ * @param priority One of enum thread_task_priority.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no such priority.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int
+thread_task_set_priority(struct thread_task *task, int priority);
+
+/**
+ * Set NUMA node hint of @a task for its next pushes, -1 by default.
+ * Used by NUMA aware pools for normal priority tasks only, the high
+ * and low ones are shared with all threads anyway.
+ * @param task Task to set the hint of.
+ * @param node Node to run the task on, -1 for any.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - node is less than -1.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int
+thread_task_set_node(struct thread_task *task, int node);
+
+/**
+ * Set deadline of @a task for its next pushes: the task is due
+ * @a timeout seconds after a push. The tasks with a deadline are
+ * taken before any others, the earliest deadline first. A task
+ * past its deadline is still run.
+ * @param task Task to set deadline of.
+ * @param timeout Timeout in seconds. Infinity or something huge
+ *   means no deadline, the default.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_TASK_IN_POOL - the task is in a pool.
+ */
+int
+thread_task_set_deadline(struct thread_task *task, double timeout);
+
 /**
  * Check if @a task is finished and its result can be obtained.
  * @param task Task to check.
@@ -128,6 +433,39 @@ thread_task_is_running(const struct thread_task *task);
 int
 thread_task_join(struct thread_task *task, void **result);
 
+/**
+ * Join @a count tasks, as thread_task_join() of each of them.
+ * @param tasks Tasks to join.
+ * @param count Number of the tasks.
+ * @param[out] results Array to store results of @a tasks, in
+ *   the same order. Can be NULL.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - count is negative.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - a task is not pushed to a
+ *       pool, nothing is joined.
+ */
+int
+thread_task_join_all(struct thread_task **tasks, int count, void **results);
+
+/**
+ * Join any finished task of @a tasks, wait until one is. The
+ * tasks not pushed are skipped, so the ones joined already can
+ * stay in the array for the next call.
+ * @param tasks Tasks to join one of.
+ * @param count Number of the tasks.
+ * @param[out] index Index of the joined task.
+ * @param[out] result Pointer to stored result of the task.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - count is not positive.
+ *     - TPOOL_ERR_TASK_NOT_PUSHED - no task is pushed to a pool.
+ */
+int
+thread_task_join_any(struct thread_task **tasks, int count, int *index, void **result);
+
 #ifdef NEED_TIMED_JOIN
 
 /**
@@ -175,3 +513,120 @@ int
 thread_task_detach(struct thread_task *task);
 
 #endif
+
+/** Continuations API. */
+
+/**
+ * Create a task to run @a function with the result of @a task
+ * as the argument, when @a task is finished. It is pushed by the
+ * thread which has run @a task into the same pool, no thread waits
+ * for it. If @a task is finished already, it is pushed right away.
+ * @a task can be joined, detached or continued more as usual, but
+ * must be pushed, else the continuation never runs.
+ * The continuation is a pushed task: it can be joined, detached,
+ * or continued too, and can not be deleted before it is joined.
+ * @param task Task to continue.
+ * @param function Function to run by the continuation.
+ * @param[out] next Pointer to store the continuation.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - no memory for the continuation.
+ */
+int
+thread_task_then(struct thread_task *task, thread_task_f function, struct thread_task **next);
+
+/**
+ * Create a task to run @a function with @a arg, when all of
+ * @a tasks are finished. It can join them without waiting. Same
+ * as in thread_task_then() otherwise.
+ * @param tasks Tasks to wait for.
+ * @param count Number of the tasks.
+ * @param function Function to run by the continuation.
+ * @param arg Argument for @a function.
+ * @param[out] next Pointer to store the continuation.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - count is not positive, or no
+ *       memory for the continuation.
+ */
+int
+thread_task_when_all(struct thread_task **tasks, int count, thread_task_f function, void *arg,
+		     struct thread_task **next);
+
+/**
+ * Create a task to run @a function with @a arg, when any of
+ * @a tasks is finished. It can find which one through
+ * thread_task_join_any() without waiting. Same as in
+ * thread_task_when_all() otherwise.
+ */
+int
+thread_task_when_any(struct thread_task **tasks, int count, thread_task_f function, void *arg,
+		     struct thread_task **next);
+
+/** Parallel loops API. */
+
+/** Loop body, called for the subranges [begin, end) of a loop. */
+typedef void (*thread_pool_for_f)(long begin, long end, void *ctx);
+
+/** Map of a reduction, gives the result of the subrange [begin, end). */
+typedef void *(*thread_pool_range_f)(long begin, long end, void *ctx);
+
+/** Join of a reduction, combines results of two adjacent subranges. */
+typedef void *(*thread_pool_join_f)(void *left, void *right, void *ctx);
+
+/**
+ * Run @a fn over [@a begin, @a end) split into subranges, in the
+ * pool threads and the calling one. The range is split adaptively:
+ * a thread halves its range only when the previous half it gave
+ * away is taken by another thread, else it runs the range by
+ * @a grain items. So the pool threads busy with other work get no
+ * extra tasks. Returns when all the range is done.
+ * @param pool Pool to run in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain The smallest subrange. 0 - chosen by the pool.
+ * @param fn Loop body.
+ * @param ctx Argument for @a fn.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - begin is after end, or
+ *       grain is negative.
+ */
+int
+thread_pool_parallel_for(struct thread_pool *pool, long begin, long end, long grain, thread_pool_for_f fn, void *ctx);
+
+/**
+ * Same as thread_pool_parallel_for(), but the range is split into
+ * the subranges of @a grain items right away, whether the pool
+ * threads are free or not. Better for evenly heavy iterations in
+ * an otherwise idle pool.
+ */
+int
+thread_pool_parallel_for_static(struct thread_pool *pool, long begin, long end, long grain, thread_pool_for_f fn,
+				void *ctx);
+
+/**
+ * Reduce [@a begin, @a end): @a map gives results of subranges
+ * split as in thread_pool_parallel_for(), and @a join combines the
+ * results of adjacent ones, in order left to right, so @a join
+ * needs to be associative only. An empty range is mapped once.
+ * @param pool Pool to run in.
+ * @param begin First index.
+ * @param end Index after the last one.
+ * @param grain The smallest subrange. 0 - chosen by the pool.
+ * @param map Result of a subrange.
+ * @param join Result of two adjacent subranges.
+ * @param ctx Argument for @a map and @a join.
+ * @param[out] result Pointer to store result of the range.
+ *
+ * @retval 0 Success.
+ * @retval != 0 Error code.
+ *     - TPOOL_ERR_INVALID_ARGUMENT - begin is after end, or
+ *       grain is negative.
+ */
+int
+thread_pool_parallel_reduce(struct thread_pool *pool, long begin, long end, long grain, thread_pool_range_f map,
+			    thread_pool_join_f join, void *ctx, void **result);
@@ -0,0 +1,76 @@
+#include "time_hist.h"
+
+/* The single writer does not need an atomic increment. */
+static void
+counter_add(atomic_ullong *counter, unsigned long long value) {
+	unsigned long long old = atomic_load_explicit(counter, memory_order_relaxed);
+	atomic_store_explicit(counter, old + value, memory_order_relaxed);
+}
+
+static int
+bucket_of(uint64_t ns) {
+	if (ns < TIME_HIST_SUB_COUNT)
+		return ns;
+	int exp = 63 - __builtin_clzll(ns);
+	int sub = (ns >> (exp - TIME_HIST_SUB_BITS)) & (TIME_HIST_SUB_COUNT - 1);
+	return (exp - TIME_HIST_SUB_BITS + 1) * TIME_HIST_SUB_COUNT + sub;
+}
+
+/* The biggest value of a bucket. */
+static uint64_t
+bucket_end(int bucket) {
+	if (bucket < TIME_HIST_SUB_COUNT)
+		return bucket;
+	int exp = bucket / TIME_HIST_SUB_COUNT + TIME_HIST_SUB_BITS - 1;
+	uint64_t sub = bucket % TIME_HIST_SUB_COUNT;
+	uint64_t width = 1ull << (exp - TIME_HIST_SUB_BITS);
+	return ((TIME_HIST_SUB_COUNT + sub) << (exp - TIME_HIST_SUB_BITS)) + width - 1;
+}
+
+void
+time_hist_add(struct time_hist *hist, uint64_t ns) {
+	counter_add(&hist->count, 1);
+	counter_add(&hist->total_ns, ns);
+	if (ns > atomic_load_explicit(&hist->max_ns, memory_order_relaxed))
+		atomic_store_explicit(&hist->max_ns, ns, memory_order_relaxed);
+	counter_add(&hist->buckets[bucket_of(ns)], 1);
+}
+
+void
+time_hist_merge(struct time_hist *dst, const struct time_hist *src) {
+	counter_add(&dst->count, atomic_load_explicit(&src->count, memory_order_relaxed));
+	counter_add(&dst->total_ns, atomic_load_explicit(&src->total_ns, memory_order_relaxed));
+	unsigned long long max_ns = atomic_load_explicit(&src->max_ns, memory_order_relaxed);
+	if (max_ns > atomic_load_explicit(&dst->max_ns, memory_order_relaxed))
+		atomic_store_explicit(&dst->max_ns, max_ns, memory_order_relaxed);
+	for (int i = 0; i < TIME_HIST_BUCKETS; i++)
+		counter_add(&dst->buckets[i], atomic_load_explicit(&src->buckets[i], memory_order_relaxed));
+}
+
+uint64_t
+time_hist_quantile(const struct time_hist *hist, double quantile) {
+	/*
+	 * The buckets are read one by one, while the writer goes on, so
+	 * the count is taken from them, not from the count field.
+	 */
+	unsigned long long count = 0;
+	for (int i = 0; i < TIME_HIST_BUCKETS; i++)
+		count += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+	if (count == 0)
+		return 0;
+	unsigned long long rank = (unsigned long long) (quantile * count);
+	if (rank < quantile * count)
+		rank++;
+	if (rank == 0)
+		rank = 1;
+	unsigned long long seen = 0;
+	uint64_t max_ns = atomic_load_explicit(&hist->max_ns, memory_order_relaxed);
+	for (int i = 0; i < TIME_HIST_BUCKETS; i++) {
+		seen += atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+		if (seen >= rank) {
+			uint64_t end = bucket_end(i);
+			return end < max_ns ? end : max_ns;
+		}
+	}
+	return max_ns;
+}
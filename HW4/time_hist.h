@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * Histogram of durations in nanoseconds, HDR style: every power of 2
+ * range is split into TIME_HIST_SUB_COUNT equal buckets, so a bucket
+ * is within 1/8 of its values at any scale, with a fixed size and
+ * no allocations. It has a single writer, which updates it with no
+ * read-modify-write, while the others can read it at any time.
+ */
+
+enum {
+	TIME_HIST_SUB_BITS = 3,
+	TIME_HIST_SUB_COUNT = 1 << TIME_HIST_SUB_BITS,
+	/* The values below TIME_HIST_SUB_COUNT have a bucket each. */
+	TIME_HIST_BUCKETS = (64 - TIME_HIST_SUB_BITS + 1) * TIME_HIST_SUB_COUNT,
+};
+
+struct time_hist {
+	atomic_ullong count;
+	atomic_ullong total_ns;
+	atomic_ullong max_ns;
+	atomic_ullong buckets[TIME_HIST_BUCKETS];
+};
+
+/** Add a value, by the writer only. */
+void
+time_hist_add(struct time_hist *hist, uint64_t ns);
+
+/** Add all values of @a src to @a dst, @a dst has no other writers. */
+void
+time_hist_merge(struct time_hist *dst, const struct time_hist *src);
+
+/**
+ * Value below which @a quantile of the values are, 0 < quantile <= 1,
+ * rounded up to the end of its bucket. 0 if the histogram is empty.
+ */
+uint64_t
+time_hist_quantile(const struct time_hist *hist, double quantile);
@@ -0,0 +1,76 @@
+#include "ws_deque.h"
+#include <stdlib.h>
+
+int
+ws_deque_create(struct ws_deque *d, size_t capacity) {
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+	d->items = malloc(size * sizeof(d->items[0]));
+	if (d->items == NULL)
+		return -1;
+	d->mask = size - 1;
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	return 0;
+}
+
+void
+ws_deque_destroy(struct ws_deque *d) {
+	free(d->items);
+	d->items = NULL;
+}
+
+bool
+ws_deque_push(struct ws_deque *d, void *data) {
+	ptrdiff_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	ptrdiff_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	if (b - t > d->mask)
+		return false;
+	atomic_store_explicit(&d->items[b & d->mask], data, memory_order_relaxed);
+	/* The element is visible before the thieves can see the new bottom. */
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	return true;
+}
+
+void *
+ws_deque_pop(struct ws_deque *d) {
+	ptrdiff_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	/* Either a thief sees the reserved bottom, or the owner sees its top. */
+	atomic_thread_fence(memory_order_seq_cst);
+	ptrdiff_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+	if (t > b) {
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return NULL;
+	}
+	void *data = atomic_load_explicit(&d->items[b & d->mask], memory_order_relaxed);
+	if (t == b) {
+		/* The last element - race with the thieves for it. */
+		if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+							     memory_order_relaxed))
+			data = NULL;
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+	}
+	return data;
+}
+
+void *
+ws_deque_steal(struct ws_deque *d) {
+	ptrdiff_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	ptrdiff_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (t >= b)
+		return NULL;
+	void *data = atomic_load_explicit(&d->items[t & d->mask], memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+						     memory_order_relaxed))
+		return NULL;
+	return data;
+}
+
+bool
+ws_deque_is_empty(struct ws_deque *d) {
+	return atomic_load(&d->bottom) <= atomic_load(&d->top);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Chase-Lev work-stealing deque of pointers with a fixed capacity. The
+ * owner thread pushes and pops at the bottom, LIFO, so it goes on with
+ * the freshest and cache-hot work. Other threads steal from the top,
+ * the oldest and usually biggest pieces. Only a pop of the last element
+ * races with thieves, the owner does no CAS otherwise.
+ */
+
+struct ws_deque {
+	_Atomic(void *) *items;
+	ptrdiff_t mask;
+	atomic_ptrdiff_t top;
+	/* The thieves do not share a cache line with the owner. */
+	char pad[64 - sizeof(atomic_ptrdiff_t)];
+	atomic_ptrdiff_t bottom;
+};
+
+/**
+ * Create an empty deque for at least @a capacity elements.
+ * @retval 0 Success.
+ * @retval -1 No memory.
+ */
+int
+ws_deque_create(struct ws_deque *d, size_t capacity);
+
+void
+ws_deque_destroy(struct ws_deque *d);
+
+/** Push to the bottom, by the owner only. False, if the deque is full. */
+bool
+ws_deque_push(struct ws_deque *d, void *data);
+
+/** Pop from the bottom, by the owner only. NULL, if empty. */
+void *
+ws_deque_pop(struct ws_deque *d);
+
+/**
+ * Steal from the top, by any thread. NULL, if the deque is empty or
+ * another thread has won the element.
+ */
+void *
+ws_deque_steal(struct ws_deque *d);
+
+/** True, if the deque seems empty. Exact only for the owner. */
+bool
+ws_deque_is_empty(struct ws_deque *d);